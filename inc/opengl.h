@@ -3,12 +3,21 @@
 #include <GL/glu.h>
 #include "glext.h"
 
+// Probe results for one driver and texture size, -1 where nothing is known yet
+typedef struct
+{
+    int gpuConversion;
+    int textureFormat;
+} OpenGLProbeCache;
+
 void OpenGL_Init();
 BOOL OpenGL_ExtExists(char *ext, HDC hdc);
 GLuint OpenGL_BuildProgram(const GLchar *vertSource, const GLchar *fragSource);
 GLuint OpenGL_BuildProgramFromFile(const char *filePath);
 BOOL TextureUploadTest(int width, int height, GLint internalFormat, GLenum format, GLenum type);
 BOOL ShaderTest(GLuint convProgram, int width, int height, GLint internalFormat, GLenum format, GLenum type);
+void OpenGL_LoadProbeCache(OpenGLProbeCache *cache, int width, int height);
+void OpenGL_SaveProbeCache(const OpenGLProbeCache *cache, int width, int height);
 
 extern PFNWGLSWAPINTERVALEXT wglSwapIntervalEXT;
 
@@ -44,6 +53,9 @@ extern PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
 extern PFNGLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray;
 extern PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
 extern PFNGLGETACTIVEUNIFORMPROC glGetActiveUniform;
+extern PFNGLGETPROGRAMBINARYPROC glGetProgramBinary;
+extern PFNGLPROGRAMBINARYPROC glProgramBinary;
+extern PFNGLPROGRAMPARAMETERIPROC glProgramParameteri;
 
 // Shader
 extern PFNGLCREATESHADERPROC glCreateShader;
@@ -59,6 +71,9 @@ extern PFNGLBUFFERDATAPROC	glBufferData;
 extern PFNGLBUFFERSUBDATAPROC   glBufferSubData;
 extern PFNGLMAPBUFFERPROC       glMapBuffer;
 extern PFNGLUNMAPBUFFERPROC     glUnmapBuffer;
+extern PFNGLMAPBUFFERRANGEPROC glMapBufferRange;
+extern PFNGLCOPYBUFFERSUBDATAPROC glCopyBufferSubData;
+extern PFNGLBUFFERSTORAGEPROC glBufferStorage;
 extern PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
 extern PFNGLDELETEBUFFERSPROC glDeleteBuffers;
 extern PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
@@ -67,6 +82,11 @@ extern PFNGLDELETEVERTEXARRAYSPROC glDeleteVertexArrays;
 
 extern PFNGLACTIVETEXTUREPROC glActiveTexture;
 
+// Sync
+extern PFNGLFENCESYNCPROC glFenceSync;
+extern PFNGLCLIENTWAITSYNCPROC glClientWaitSync;
+extern PFNGLDELETESYNCPROC glDeleteSync;
+
 extern PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
 extern PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
 extern PFNGLBLITFRAMEBUFFERPROC glBlitFramebuffer;
@@ -18,6 +18,7 @@
 #include "IDirectDraw.h"
 #include "IDirectDrawClipper.h"
 #include "IDirectDrawSurface.h"
+#include "blit.h"
 
  // use these to enable stretching for testing
  // works only fullscreen right now
@@ -40,13 +41,15 @@ IDirectDrawImpl *IDirectDrawImpl_construct()
     this->dd = this;
 
     this->ref++;
-    timeBeginPeriod(1);
+    Blit_Init();
     ddraw = this;
 
     this->glInfo.glSupported = false;
     this->glInfo.initialized = false;
     this->glInfo.pboSupported = false;
 
+    this->resumeEvent = CreateEvent(NULL, false, false, NULL);
+
     dprintf("<-- IDirectDraw::construct() -> %p\n", this);
     return this;
 }
@@ -85,7 +88,7 @@ static ULONG __stdcall _Release(IDirectDrawImpl *this)
     {
         if (this->ref == 0)
         {
-            timeEndPeriod(1);
+            CloseHandle(this->resumeEvent);
             free(this);
         }
     }
@@ -727,6 +730,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         }
         case WM_PAINT:
         {
+            // the GDI renderer only presents damage, have it repaint everything
+            InterlockedExchange(&this->render.repaint, TRUE);
+            SetEvent(this->resumeEvent);
+
             if (redrawCount > 0)
             {
                 redrawCount--;
@@ -776,6 +783,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE | RDW_ALLCHILDREN);
                 this->render.invalidate = TRUE;
                 InterlockedExchange(&this->dd->focusGained, true);
+                SetEvent(this->resumeEvent);
             }
             else if (wParam == WA_INACTIVE)
             {
@@ -819,6 +827,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             break;
 
         case WM_SIZE:
+            if (wParam != SIZE_MINIMIZED)
+                SetEvent(this->resumeEvent);
+
             switch (wParam)
             {
             case SIZE_MAXIMIZED:
@@ -94,6 +94,7 @@ struct IDirectDrawImpl
     struct
     {
         BOOL invalidate;
+        LONG repaint;
         BOOL stretched;
         int width;
         int height;
@@ -116,6 +117,8 @@ struct IDirectDrawImpl
     } glInfo;
 
     LONG focusGained;
+    // Wakes a suspended renderer when the window may be visible again
+    HANDLE resumeEvent;
     LONG mouseIsLocked;
 
     LONG edgeDimension;
@@ -17,6 +17,7 @@
 #include "main.h"
 #include "IDirectDrawClipper.h"
 #include "IDirectDrawSurface.h"
+#include "blit.h"
 #include <stdint.h>
 #include <stdio.h>
 
@@ -64,6 +65,18 @@ IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDIm
         }
     }
 
+    if (lpDDSurfaceDesc->dwFlags & DDSD_CKSRCBLT)
+    {
+        this->colorKeyFlags |= DDCKEY_SRCBLT;
+        this->srcColorKey = lpDDSurfaceDesc->ddckCKSrcBlt;
+    }
+
+    if (lpDDSurfaceDesc->dwFlags & DDSD_CKDESTBLT)
+    {
+        this->colorKeyFlags |= DDCKEY_DESTBLT;
+        this->destColorKey = lpDDSurfaceDesc->ddckCKDestBlt;
+    }
+
     this->lXPitch = this->bpp / 8;
     this->lPitch = this->width * this->lXPitch;
 
@@ -105,10 +118,11 @@ IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDIm
     this->systemSurface = this->surface;
 
     InitializeCriticalSection(&this->lock);
+    DirtyRegion_Init(&this->dirty, this->width, this->height, DirtyRectThreshold);
 
     if (this->dwCaps & DDSCAPS_PRIMARYSURFACE)
     {
-        this->syncEvent = CreateEvent(NULL, true, false, NULL);
+        this->syncEvent = CreateEvent(NULL, false, false, NULL);
         this->pSurfaceReady = CreateEvent(NULL, true, false, NULL);
         this->pSurfaceDrawn = CreateEvent(NULL, true, false, NULL);
 
@@ -118,7 +132,12 @@ IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDIm
         {
             dprintf("Renderer set to higher priority.\n");
         }
-        WaitForSingleObject(this->pSurfaceReady, INFINITE);
+
+        // Asynchronously the game starts drawing into the DIB right away and the renderer swaps the surface later.
+        // Off by default, a game that keeps writing through a pointer it got from Lock after Unlock loses those
+        // writes once the surface has moved
+        if (!AsyncRenderer)
+            WaitForSingleObject(this->pSurfaceReady, INFINITE);
     }
 
 
@@ -167,6 +186,7 @@ static ULONG __stdcall _Release(IDirectDrawSurfaceImpl *this)
         {
             HANDLE thread = this->thread;
             this->thread = NULL;
+            SetEvent(this->dd->resumeEvent);
             dprintf("Waiting for renderer to stop.\n");
             WaitForSingleObject(thread, INFINITE);
             dprintf("Renderer stopped.\n");
@@ -187,7 +207,16 @@ static ULONG __stdcall _Release(IDirectDrawSurfaceImpl *this)
         if (this->pboCount > 0)
         {
             free(this->pbo);
+            free(this->pboFences);
+            free(this->pboStale);
+        }
+        if (this->watchSurface)
+        {
+            VirtualFree(this->watchSurface, 0, MEM_RELEASE);
+            free(this->watchPages);
         }
+        Blit_FreeStretchCache(&this->stretchCache);
+        Blit_FreeSpans(&this->spans);
         free(this);
     }
 
@@ -207,111 +236,272 @@ HRESULT __stdcall _AddOverlayDirtyRect(IDirectDrawSurfaceImpl *this, LPRECT a)
     return DD_OK;
 }
 
-static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, LPDIRECTDRAWSURFACE lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwFlags, LPDDBLTFX lpDDBltFx)
+/* records damage for the render thread, NULL means the whole surface */
+static void AddDirtyRect(IDirectDrawSurfaceImpl *this, const RECT *rc)
 {
-    ENTER;
-    dprintf(
-        "--> IDirectDrawSurface::Blt(this=%p, lpDestRect=%p, lpDDSrcSurface=%p, lpSrcRect=%p, dwFlags=%08X, lpDDBltFx=%p)\n",
-        this, lpDestRect, lpDDSrcSurface, lpSrcRect, (int)dwFlags, lpDDBltFx);
+    // only the primary surface gets uploaded, with a write watch the render thread finds the writes itself
+    if ((this->dwCaps & DDSCAPS_PRIMARYSURFACE) && !(this->watchSurface && this->surface == this->watchSurface))
+        DirtyRegion_Add(&this->dirty, rc);
+}
 
-    HRESULT ret = DD_OK;
-    IDirectDrawSurfaceImpl *srcImpl = (IDirectDrawSurfaceImpl *)lpDDSrcSurface;
+/* copies only the opaque runs of a keyed source, the run table is rebuilt after the source changed */
+static BOOL BltKeySrcSpans(uint8_t *dest_base, int dstPitch, IDirectDrawSurfaceImpl *srcImpl, int x, int y, int w, int h, uint16_t key)
+{
+    // whoever holds the source can change it, the masked copy doesn't need the table
+    if (!TryEnterCriticalSection(&srcImpl->lock))
+        return FALSE;
 
-    if (PROXY)
+    // the lock is recursive, this thread may still be writing through a Lock pointer of its own
+    if (srcImpl->locks > 0)
     {
-        ret = IDirectDrawSurface_Blt(this->real, lpDestRect, lpDDSrcSurface, lpSrcRect, dwFlags, lpDDBltFx);
+        LeaveCriticalSection(&srcImpl->lock);
+        return FALSE;
     }
-    else
+
+    BlitSpanTable *spans = &srcImpl->spans;
+
+    if (!spans->valid || spans->key != key)
+        Blit_BuildSpans16(spans, srcImpl->surface, srcImpl->lPitch, srcImpl->width, srcImpl->height, key);
+
+    BOOL ret = spans->valid && spans->sparse;
+
+    if (ret)
+        Blit_CopySpans16(spans, dest_base, dstPitch, srcImpl->surface, srcImpl->lPitch, x, y, w, h);
+
+    LeaveCriticalSection(&srcImpl->lock);
+    return ret;
+}
+
+static int BltMirror(DWORD dwFlags, LPDDBLTFX lpDDBltFx)
+{
+    int mirror = 0;
+
+    if ((dwFlags & DDBLT_DDFX) && lpDDBltFx)
     {
-        static BOOL eventSet = false;
-        if (this->dwCaps & DDSCAPS_PRIMARYSURFACE && !eventSet)
-        {
-            SetEvent(this->pSurfaceDrawn);
-            eventSet = true;
-        }
+        if (lpDDBltFx->dwDDFX & DDBLTFX_MIRRORLEFTRIGHT)
+            mirror |= BLIT_MIRROR_X;
 
-        RECT src = { 0, 0, srcImpl ? srcImpl->width : 0, srcImpl ? srcImpl->height : 0};
-        RECT dst = { 0, 0, this->width, this->height };
+        if (lpDDBltFx->dwDDFX & DDBLTFX_MIRRORUPDOWN)
+            mirror |= BLIT_MIRROR_Y;
+    }
 
-        if (lpSrcRect)
-        {
-            memcpy(&src, lpSrcRect, sizeof(src));
+    return mirror;
+}
 
-            if (src.right > srcImpl->width)
-                src.right = srcImpl->width;
+static BOOL BltKeyed(IDirectDrawSurfaceImpl *this, IDirectDrawSurfaceImpl *srcImpl, DWORD dwFlags, LPDDBLTFX lpDDBltFx)
+{
+    return ((dwFlags & (DDBLT_KEYSRCOVERRIDE | DDBLT_KEYDESTOVERRIDE)) && lpDDBltFx)
+        || ((dwFlags & DDBLT_KEYSRC) && (srcImpl->colorKeyFlags & DDCKEY_SRCBLT))
+        || ((dwFlags & DDBLT_KEYDEST) && (this->colorKeyFlags & DDCKEY_DESTBLT));
+}
 
-            if (src.bottom > srcImpl->height)
-                src.bottom = srcImpl->height;
-        }
+/* the source rectangle a Blt reads after trimming, returns whether it goes through the stretch kernels */
+static BOOL BltSource(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, IDirectDrawSurfaceImpl *srcImpl, LPRECT lpSrcRect,
+                      int mirror, BOOL keyed, RECT *src)
+{
+    RECT dst = { 0, 0, this->width, this->height };
+    BlitRect rect = { 0, 0, srcImpl->width, srcImpl->height };
 
-        if (lpDestRect)
-        {
-            memcpy(&dst, lpDestRect, sizeof(dst));
+    if (lpDestRect)
+        dst = *lpDestRect;
 
-            if (dst.right > this->width)
-                dst.right = this->width;
+    if (lpSrcRect)
+    {
+        rect.x = lpSrcRect->left;
+        rect.y = lpSrcRect->top;
+        rect.w = lpSrcRect->right - lpSrcRect->left;
+        rect.h = lpSrcRect->bottom - lpSrcRect->top;
+    }
 
-            if (dst.bottom > this->height)
-                dst.bottom = this->height;
-        }
+    BOOL stretch = Blit_TrimSource(&rect, srcImpl->width, srcImpl->height, dst.right - dst.left, dst.bottom - dst.top,
+                                   mirror, keyed);
 
-        if ((dwFlags & DDBLT_COLORFILL) && this->surface)
-        {
-            EnterCriticalSection(&this->lock);
+    SetRect(src, rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+    return stretch;
+}
 
-            int dst_w = dst.right - dst.left;
-            int dst_h = dst.bottom - dst.top;
+/* does the pixel work of a single Blt, this->lock has to be held and writes stay inside band */
+static void BltLocked(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, IDirectDrawSurfaceImpl *srcImpl, LPRECT lpSrcRect,
+                      DWORD dwFlags, LPDDBLTFX lpDDBltFx, const RECT *band)
+{
+    RECT dst = { 0, 0, this->width, this->height };
 
-            for (int y = 0; y < dst_h; y++)
-            {
-                int ydst = this->width * (y + dst.top);
+    if (lpDestRect)
+    {
+        memcpy(&dst, lpDestRect, sizeof(dst));
+    }
 
-                for (int x = 0; x < dst_w; x++)
-                {
-                    this->surface[x + dst.left + ydst] = lpDDBltFx->dwFillColor;
-                }
-            }
+    // writes are clipped to the surface, stretching still scales against the requested rectangle
+    RECT clip = { 0, 0, this->width, this->height };
 
-            LeaveCriticalSection(&this->lock);
+    if (band)
+        IntersectRect(&clip, &clip, band);
+
+    IntersectRect(&clip, &clip, &dst);
+
+    int clip_w = clip.right - clip.left;
+    int clip_h = clip.bottom - clip.top;
+
+    this->spans.valid = false;
+
+    if ((dwFlags & DDBLT_COLORFILL) && this->surface)
+    {
+        uint8_t *dest_base = (uint8_t*)this->surface + (clip.left * this->lXPitch) + (this->lPitch * clip.top);
+
+        // mapped PBO memory is write-combined, bypass the cache there
+        Blit_Fill16(dest_base, this->lPitch, clip_w, clip_h, (uint16_t)lpDDBltFx->dwFillColor, this->usingPBO);
+    }
+
+    if (srcImpl)
+    {
+        BOOL keySrc = FALSE;
+        uint16_t srcKey = 0;
+
+        if ((dwFlags & DDBLT_KEYSRCOVERRIDE) && lpDDBltFx)
+        {
+            keySrc = TRUE;
+            srcKey = (uint16_t)lpDDBltFx->ddckSrcColorkey.dwColorSpaceLowValue;
         }
+        else if ((dwFlags & DDBLT_KEYSRC) && (srcImpl->colorKeyFlags & DDCKEY_SRCBLT))
+        {
+            keySrc = TRUE;
+            srcKey = (uint16_t)srcImpl->srcColorKey.dwColorSpaceLowValue;
+        }
+
+        BOOL keyDest = FALSE;
+        uint16_t destKey = 0;
 
-        if (lpDDSrcSurface)
+        if ((dwFlags & DDBLT_KEYDESTOVERRIDE) && lpDDBltFx)
         {
-            EnterCriticalSection(&this->lock);
+            keyDest = TRUE;
+            destKey = (uint16_t)lpDDBltFx->ddckDestColorkey.dwColorSpaceLowValue;
+        }
+        else if ((dwFlags & DDBLT_KEYDEST) && (this->colorKeyFlags & DDCKEY_DESTBLT))
+        {
+            keyDest = TRUE;
+            destKey = (uint16_t)this->destColorKey.dwColorSpaceLowValue;
+        }
+
+        int mirror = BltMirror(dwFlags, lpDDBltFx);
+        RECT src;
+        BOOL stretch = BltSource(this, lpDestRect, srcImpl, lpSrcRect, mirror, keySrc || keyDest, &src);
 
-            int dst_w = dst.right - dst.left;
-            int dst_h = dst.bottom - dst.top;
+        int dst_w = dst.right - dst.left;
+        int dst_h = dst.bottom - dst.top;
 
-            int src_w = src.right - src.left;
-            int src_h = src.bottom - src.top;
+        int src_w = src.right - src.left;
+        int src_h = src.bottom - src.top;
 
-            int dst_byte_width = dst_w * this->lXPitch;
+        uint8_t *dest_base = (uint8_t*)this->surface + (clip.left * this->lXPitch) + (this->lPitch * clip.top);
+        uint8_t *src_origin = (uint8_t*)srcImpl->surface + (src.left * srcImpl->lXPitch) + (srcImpl->lPitch * src.top);
+        int src_pitch = srcImpl->lPitch;
+        uint8_t *snapshot = NULL;
+        RECT overlap;
 
-            if (dst_w == src_w && dst_h == src_h)
+        // plain copies within a surface move in place, anything else reads a snapshot of the overlapping source
+        if (srcImpl == this && IntersectRect(&overlap, &src, &clip)
+            && (stretch || mirror || keySrc || keyDest) && src_w > 0 && src_h > 0)
+        {
+            snapshot = malloc(src_w * src_h * 2);
+
+            if (snapshot)
             {
-                if (this->usingPBO)
-                {
-                    // Sometimes radar surface will have an odd lPitch, BitBlt won't work in those cases
-                    uint8_t *dest_base = (uint8_t*)this->surface + (dst.left * this->lXPitch) + (this->lPitch * dst.top);
-                    uint8_t *src_base = (uint8_t*)srcImpl->surface + (src.left * this->lXPitch) + (srcImpl->lPitch * src.top);
+                Blit_Copy16(snapshot, src_w * 2, src_origin, src_pitch, src_w, src_h);
+                src_origin = snapshot;
+                src_pitch = src_w * 2;
+            }
+        }
 
-                    while (dst_h-- > 0)
-                    {
-                        memcpy((void *)dest_base, (void *)src_base, dst_byte_width);
+        if (!stretch)
+        {
+            int x = clip.left - dst.left;
+            int y = clip.top - dst.top;
 
-                        dest_base += this->lPitch;
-                        src_base += srcImpl->lPitch;
-                    }
-                }
-                else
-                    BitBlt(this->hDC, dst.left, dst.top, dst_w, dst_h, srcImpl->hDC, src.left, src.top, SRCCOPY);
+            // a mirrored blit reads its block from the opposite edge of the source
+            if (mirror & BLIT_MIRROR_X)
+                x = dst_w - x - clip_w;
+
+            if (mirror & BLIT_MIRROR_Y)
+                y = dst_h - y - clip_h;
+
+            uint8_t *src_base = src_origin + (x * srcImpl->lXPitch) + (src_pitch * y);
+
+            if (keySrc)
+            {
+                if (srcImpl == this || !BltKeySrcSpans(dest_base, this->lPitch, srcImpl, src.left + x, src.top + y, clip_w, clip_h, srcKey))
+                    Blit_CopyKeySrc16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h, srcKey);
+            }
+            else if (keyDest)
+            {
+                // byte pitches, odd radar pitches go through the unaligned loads
+                Blit_CopyKeyDest16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h, destKey);
+            }
+            else if (mirror)
+            {
+                Blit_CopyMirror16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h, mirror);
+            }
+            else if (srcImpl == this)
+            {
+                // scrolling within the surface, rows are ordered so nothing is overwritten before it is read
+                Blit_Move16(dest_base, src_base, this->lPitch, clip_w, clip_h);
+            }
+            else if (GdiBlt && this->surface == this->systemSurface)
+            {
+                BitBlt(this->hDC, clip.left, clip.top, clip_w, clip_h, srcImpl->hDC, src.left + x, src.top + y, SRCCOPY);
             }
             else
             {
-                StretchBlt(this->hDC, dst.left, dst.top, dst_w, dst_h, srcImpl->hDC, src.left, src.top, src_w, src_h, SRCCOPY);
+                // both sides are 565 DIBs we own, skip GDI. Sometimes radar surface will have an odd lPitch,
+                // BitBlt won't work in those cases anyway
+                Blit_Copy16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h);
             }
-            LeaveCriticalSection(&this->lock);
         }
+        else
+        {
+            BlitRect visible = { clip.left - dst.left, clip.top - dst.top, clip_w, clip_h };
+
+            if (keySrc)
+                Blit_StretchKeySrc16(&this->stretchCache, dest_base, this->lPitch, dst_w, dst_h, &visible,
+                                     src_origin, src_pitch, src_w, src_h, srcKey, mirror);
+            else if (keyDest)
+                Blit_StretchKeyDest16(&this->stretchCache, dest_base, this->lPitch, dst_w, dst_h, &visible,
+                                      src_origin, src_pitch, src_w, src_h, destKey, mirror);
+            else
+                Blit_Stretch16(&this->stretchCache, dest_base, this->lPitch, dst_w, dst_h, &visible,
+                               src_origin, src_pitch, src_w, src_h, BilinearBlt, mirror);
+        }
+
+        free(snapshot);
+    }
+}
+
+static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, LPDIRECTDRAWSURFACE lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwFlags, LPDDBLTFX lpDDBltFx)
+{
+    ENTER;
+    dprintf(
+        "--> IDirectDrawSurface::Blt(this=%p, lpDestRect=%p, lpDDSrcSurface=%p, lpSrcRect=%p, dwFlags=%08X, lpDDBltFx=%p)\n",
+        this, lpDestRect, lpDDSrcSurface, lpSrcRect, (int)dwFlags, lpDDBltFx);
+
+    HRESULT ret = DD_OK;
+    IDirectDrawSurfaceImpl *srcImpl = (IDirectDrawSurfaceImpl *)lpDDSrcSurface;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_Blt(this->real, lpDestRect, lpDDSrcSurface, lpSrcRect, dwFlags, lpDDBltFx);
+    }
+    else
+    {
+        static BOOL eventSet = false;
+        if (this->dwCaps & DDSCAPS_PRIMARYSURFACE && !eventSet)
+        {
+            SetEvent(this->pSurfaceDrawn);
+            eventSet = true;
+        }
+
+        EnterCriticalSection(&this->lock);
+        BltLocked(this, lpDestRect, srcImpl, lpSrcRect, dwFlags, lpDDBltFx, NULL);
+        AddDirtyRect(this, lpDestRect);
+        LeaveCriticalSection(&this->lock);
     }
 
     if (dwFlags)
@@ -347,6 +537,16 @@ static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, L
         dprintf("  DDBLT_KEYSRCOVERRIDE\n");
     }
 
+    if (dwFlags & DDBLT_KEYSRC)
+    {
+        dprintf("  DDBLT_KEYSRC\n");
+    }
+
+    if (dwFlags & DDBLT_KEYDEST)
+    {
+        dprintf("  DDBLT_KEYDEST\n");
+    }
+
     if (dwFlags & DDBLT_ROP)
     {
         dprintf("  DDBLT_ROP\n");
@@ -384,16 +584,279 @@ static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, L
     return ret;
 }
 
-HRESULT __stdcall _BltBatch(IDirectDrawSurfaceImpl *this, LPDDBLTBATCH a, DWORD b, DWORD c)
+#define BATCH_SPLIT_AREA (640 * 480)
+#define BATCH_MAX_BANDS 4
+
+typedef struct
 {
-    dprintf("IDirectDrawSurface::BltBatch(this=%p, ...)\n", this);
-    return DD_OK;
+    IDirectDrawSurfaceImpl *this;
+    LPDDBLTBATCH lpDDBltBatch;
+    DWORD *order;
+    DWORD count;
+    RECT band;
+    LONG *pending;
+    HANDLE done;
+} BltBatchBand;
+
+static void BltBatchRun(BltBatchBand *work)
+{
+    for (DWORD i = 0; i < work->count; i++)
+    {
+        LPDDBLTBATCH blt = &work->lpDDBltBatch[work->order[i]];
+
+        BltLocked(work->this, blt->lprDest, (IDirectDrawSurfaceImpl *)blt->lpDDSSrc, blt->lprSrc, blt->dwFlags,
+                  blt->lpDDBltFx, &work->band);
+    }
 }
 
-HRESULT __stdcall _BltFast(IDirectDrawSurfaceImpl *this, DWORD a, DWORD b, LPDIRECTDRAWSURFACE c, LPRECT d, DWORD e)
+static DWORD WINAPI BltBatchThread(BltBatchBand *work)
 {
-    dprintf("IDirectDrawSurface::BltFast(this=%p, ...)\n", this);
-    return DD_OK;
+    BltBatchRun(work);
+
+    if (InterlockedDecrement(work->pending) == 0 && work->done)
+        SetEvent(work->done);
+
+    return 0;
+}
+
+static HRESULT __stdcall _BltBatch(IDirectDrawSurfaceImpl *this, LPDDBLTBATCH lpDDBltBatch, DWORD dwCount, DWORD dwFlags)
+{
+    ENTER;
+    dprintf("--> IDirectDrawSurface::BltBatch(this=%p, lpDDBltBatch=%p, dwCount=%d, dwFlags=%08X)\n", this, lpDDBltBatch, (int)dwCount, (int)dwFlags);
+
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_BltBatch(this->real, lpDDBltBatch, dwCount, dwFlags);
+    }
+    else if (!lpDDBltBatch && dwCount)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else if (dwCount)
+    {
+        DWORD *order = malloc(dwCount * sizeof(DWORD));
+        RECT *clips = malloc(dwCount * sizeof(RECT));
+
+        if (order && clips)
+        {
+            DWORD ordered = 0;
+            LONGLONG area = 0;
+
+            // GDI calls on our DC and the shared stretch tables can't be used from several threads
+            BOOL split = (this->surface != this->systemSurface || !GdiBlt) && !SingleProcAffinity;
+
+            for (DWORD i = 0; i < dwCount; i++)
+            {
+                LPDDBLTBATCH blt = &lpDDBltBatch[i];
+                IDirectDrawSurfaceImpl *srcImpl = (IDirectDrawSurfaceImpl *)blt->lpDDSSrc;
+                RECT bounds = { 0, 0, this->width, this->height };
+
+                clips[i] = bounds;
+                if (blt->lprDest)
+                    IntersectRect(&clips[i], &bounds, blt->lprDest);
+
+                area += (LONGLONG)(clips[i].right - clips[i].left) * (clips[i].bottom - clips[i].top);
+
+                // the same decision BltLocked makes, anything it sends down the stretch path stays on one thread
+                if (srcImpl)
+                {
+                    RECT src;
+
+                    if (srcImpl == this || BltSource(this, blt->lprDest, srcImpl, blt->lprSrc,
+                                                     BltMirror(blt->dwFlags, blt->lpDDBltFx),
+                                                     BltKeyed(this, srcImpl, blt->dwFlags, blt->lpDDBltFx), &src))
+                        split = FALSE;
+                }
+
+                // keep blits from the same source together unless something drawn in between overlaps them
+                DWORD pos = ordered;
+
+                if (srcImpl != this)
+                {
+                    for (DWORD j = ordered; j > 0; j--)
+                    {
+                        LPDDBLTBATCH prev = &lpDDBltBatch[order[j - 1]];
+                        RECT overlap;
+
+                        if (prev->lpDDSSrc == blt->lpDDSSrc)
+                        {
+                            pos = j;
+                            break;
+                        }
+
+                        if ((IDirectDrawSurfaceImpl *)prev->lpDDSSrc == this || IntersectRect(&overlap, &clips[order[j - 1]], &clips[i]))
+                            break;
+                    }
+                }
+
+                memmove(&order[pos + 1], &order[pos], (ordered - pos) * sizeof(DWORD));
+                order[pos] = i;
+                ordered++;
+            }
+
+            int bands = 1;
+
+            if (split && area >= BATCH_SPLIT_AREA)
+            {
+                SYSTEM_INFO si;
+                GetSystemInfo(&si);
+                bands = si.dwNumberOfProcessors < BATCH_MAX_BANDS ? si.dwNumberOfProcessors : BATCH_MAX_BANDS;
+            }
+
+            // the extra bands run on the system thread pool, threads of our own cost more than a batch saves
+            BltBatchBand work[BATCH_MAX_BANDS];
+            LONG pending = bands - 1;
+            HANDLE done = bands > 1 ? CreateEvent(NULL, TRUE, FALSE, NULL) : NULL;
+
+            EnterCriticalSection(&this->lock);
+
+            for (int b = 0; b < bands; b++)
+            {
+                work[b].this = this;
+                work[b].lpDDBltBatch = lpDDBltBatch;
+                work[b].order = order;
+                work[b].count = dwCount;
+                work[b].pending = &pending;
+                work[b].done = done;
+                SetRect(&work[b].band, 0, this->height * b / bands, this->width, this->height * (b + 1) / bands);
+
+                if (b > 0 && (!done || !QueueUserWorkItem((LPTHREAD_START_ROUTINE)BltBatchThread, &work[b], WT_EXECUTEDEFAULT)))
+                    BltBatchThread(&work[b]);
+            }
+
+            BltBatchRun(&work[0]);
+
+            if (done)
+            {
+                WaitForSingleObject(done, INFINITE);
+                CloseHandle(done);
+            }
+
+            for (DWORD i = 0; i < dwCount; i++)
+                AddDirtyRect(this, &clips[i]);
+
+            LeaveCriticalSection(&this->lock);
+
+            dprintf(" %d blits in %d bands, %d pixels\n", (int)dwCount, bands, (int)area);
+        }
+        else
+        {
+            ret = DDERR_OUTOFMEMORY;
+        }
+
+        free(order);
+        free(clips);
+    }
+
+    dprintf("<-- IDirectDrawSurface::BltBatch(this=%p, lpDDBltBatch=%p, dwCount=%d, dwFlags=%08X) -> %08X\n", this, lpDDBltBatch, (int)dwCount, (int)dwFlags, (int)ret);
+    LEAVE;
+    return ret;
+}
+
+static HRESULT __stdcall _BltFast(IDirectDrawSurfaceImpl *this, DWORD dwX, DWORD dwY, LPDIRECTDRAWSURFACE lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwTrans)
+{
+    ENTER;
+    dprintf(
+        "--> IDirectDrawSurface::BltFast(this=%p, dwX=%d, dwY=%d, lpDDSrcSurface=%p, lpSrcRect=%p, dwTrans=%08X)\n",
+        this, (int)dwX, (int)dwY, lpDDSrcSurface, lpSrcRect, (int)dwTrans);
+
+    HRESULT ret = DD_OK;
+    IDirectDrawSurfaceImpl *srcImpl = (IDirectDrawSurfaceImpl *)lpDDSrcSurface;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_BltFast(this->real, dwX, dwY, lpDDSrcSurface, lpSrcRect, dwTrans);
+    }
+    else if (!srcImpl || !srcImpl->surface || !this->surface)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else
+    {
+        RECT src = { 0, 0, srcImpl->width, srcImpl->height };
+
+        if (lpSrcRect)
+        {
+            memcpy(&src, lpSrcRect, sizeof(src));
+
+            if (src.right > srcImpl->width)
+                src.right = srcImpl->width;
+
+            if (src.bottom > srcImpl->height)
+                src.bottom = srcImpl->height;
+        }
+
+        RECT dst = { (LONG)dwX, (LONG)dwY, (LONG)dwX + src.right - src.left, (LONG)dwY + src.bottom - src.top };
+        RECT clip = { 0, 0, this->width, this->height };
+        IntersectRect(&clip, &clip, &dst);
+
+        int clip_w = clip.right - clip.left;
+        int clip_h = clip.bottom - clip.top;
+
+        int src_x = src.left + clip.left - dst.left;
+        int src_y = src.top + clip.top - dst.top;
+        BOOL keySrc = (dwTrans & DDBLTFAST_SRCCOLORKEY) && (srcImpl->colorKeyFlags & DDCKEY_SRCBLT);
+        BOOL keyDest = !keySrc && (dwTrans & DDBLTFAST_DESTCOLORKEY) && (this->colorKeyFlags & DDCKEY_DESTBLT);
+
+        EnterCriticalSection(&this->lock);
+
+        uint8_t *dest_base = (uint8_t*)this->surface + (clip.left * this->lXPitch) + (this->lPitch * clip.top);
+        uint8_t *src_base = (uint8_t*)srcImpl->surface + (src_x * srcImpl->lXPitch) + (srcImpl->lPitch * src_y);
+        int src_pitch = srcImpl->lPitch;
+        uint8_t *snapshot = NULL;
+        RECT from = { src_x, src_y, src_x + clip_w, src_y + clip_h };
+        RECT overlap;
+
+        // keyed copies work in place, so an overlapping source is read from a snapshot like BltLocked does
+        if (srcImpl == this && (keySrc || keyDest) && IntersectRect(&overlap, &from, &clip))
+        {
+            snapshot = malloc(clip_w * clip_h * 2);
+
+            if (snapshot)
+            {
+                Blit_Copy16(snapshot, clip_w * 2, src_base, src_pitch, clip_w, clip_h);
+                src_base = snapshot;
+                src_pitch = clip_w * 2;
+            }
+        }
+
+        this->spans.valid = false;
+
+        if (keySrc)
+        {
+            uint16_t key = (uint16_t)srcImpl->srcColorKey.dwColorSpaceLowValue;
+
+            if (srcImpl == this || !BltKeySrcSpans(dest_base, this->lPitch, srcImpl, src_x, src_y, clip_w, clip_h, key))
+                Blit_CopyKeySrc16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h, key);
+        }
+        else if (keyDest)
+        {
+            Blit_CopyKeyDest16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h,
+                               (uint16_t)this->destColorKey.dwColorSpaceLowValue);
+        }
+        else if (srcImpl == this)
+        {
+            // scrolling within the surface, rows are ordered so nothing is overwritten before it is read
+            Blit_Move16(dest_base, src_base, this->lPitch, clip_w, clip_h);
+        }
+        else
+        {
+            Blit_Copy16(dest_base, this->lPitch, src_base, src_pitch, clip_w, clip_h);
+        }
+
+        free(snapshot);
+        AddDirtyRect(this, &clip);
+        LeaveCriticalSection(&this->lock);
+    }
+
+    dprintf(
+        "<-- IDirectDrawSurface::BltFast(this=%p, dwX=%d, dwY=%d, lpDDSrcSurface=%p, lpSrcRect=%p, dwTrans=%08X) -> %08X\n",
+        this, (int)dwX, (int)dwY, lpDDSrcSurface, lpSrcRect, (int)dwTrans, (int)ret);
+
+    LEAVE;
+    return ret;
 }
 
 HRESULT __stdcall _DeleteAttachedSurface(IDirectDrawSurfaceImpl *this, DWORD dwFlags, LPDIRECTDRAWSURFACE lpDDSurface)
@@ -498,10 +961,37 @@ HRESULT __stdcall _GetClipper(IDirectDrawSurfaceImpl *this, LPDIRECTDRAWCLIPPER
     return DD_OK;
 }
 
-HRESULT __stdcall _GetColorKey(IDirectDrawSurfaceImpl *this, DWORD a, LPDDCOLORKEY b)
+static HRESULT __stdcall _GetColorKey(IDirectDrawSurfaceImpl *this, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey)
 {
-    dprintf("IDirectDrawSurface::GetColorKey(this=%p, ...)\n", this);
-    return DD_OK;
+    ENTER;
+    dprintf("--> IDirectDrawSurface::GetColorKey(this=%p, dwFlags=%08X, lpDDColorKey=%p)\n", this, (int)dwFlags, lpDDColorKey);
+
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_GetColorKey(this->real, dwFlags, lpDDColorKey);
+    }
+    else if (!lpDDColorKey)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else if (!(this->colorKeyFlags & dwFlags & (DDCKEY_SRCBLT | DDCKEY_DESTBLT)))
+    {
+        ret = DDERR_NOCOLORKEY;
+    }
+    else if (dwFlags & DDCKEY_SRCBLT)
+    {
+        *lpDDColorKey = this->srcColorKey;
+    }
+    else
+    {
+        *lpDDColorKey = this->destColorKey;
+    }
+
+    dprintf("<-- IDirectDrawSurface::GetColorKey(this=%p, dwFlags=%08X, lpDDColorKey=%p) -> %08X\n", this, (int)dwFlags, lpDDColorKey, (int)ret);
+    LEAVE;
+    return ret;
 }
 
 HRESULT __stdcall _GetDC(IDirectDrawSurfaceImpl *this, HDC FAR *lphDC)
@@ -603,6 +1093,9 @@ static HRESULT __stdcall _Lock(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect,
     }
     else
     {
+        // taken first, the renderer may swap the surface memory until then
+        EnterCriticalSection(&this->lock);
+
         lpDDSurfaceDesc->dwFlags |= DDSD_WIDTH|DDSD_HEIGHT|DDSD_PITCH|DDSD_PIXELFORMAT|DDSD_LPSURFACE;
         lpDDSurfaceDesc->dwWidth = this->width;
         lpDDSurfaceDesc->dwHeight = this->height;
@@ -618,7 +1111,10 @@ static HRESULT __stdcall _Lock(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect,
         lpDDSurfaceDesc->ddsCaps.dwCaps = 0x10004000;
         lpDDSurfaceDesc->ddsCaps.dwCaps = this->dwCaps;
 
-        EnterCriticalSection(&this->lock);
+        // the application writes behind our back until Unlock
+        this->locks++;
+        this->spans.valid = false;
+        AddDirtyRect(this, lpDestRect);
     }
 
     dump_ddsurfacedesc(lpDDSurfaceDesc);
@@ -643,23 +1139,16 @@ HRESULT __stdcall _ReleaseDC(IDirectDrawSurfaceImpl *this, HDC hDC)
     }
     else
     {
+        // GDI may still be batching the drawing into the overlay
+        GdiFlush();
+
         // FIXME: using black as magic transparency color
-        for (int y = 0; y < this->height; y++)
-        {
-            int ydst = this->width * y;
+        Blit_CopyKeySrc16(this->surface, this->lPitch, this->overlay, this->lPitch, this->width, this->height, 0);
 
-            for (int x = 0; x < this->width; x++)
-            {
-                unsigned short px = this->overlay[x + ydst];
-                if (px)
-                {
-                    this->surface[x + ydst] = px;
-                }
-            }
-        }
+        this->spans.valid = false;
+        AddDirtyRect(this, NULL);
 
-        RECT rc = { 0, 0, this->width, this->height };
-        FillRect(this->overlayDC, &rc, CreateSolidBrush(RGB(0,0,0)));
+        Blit_Fill16(this->overlay, this->lPitch, this->width, this->height, 0, false);
         LeaveCriticalSection(&this->lock);
     }
 
@@ -694,10 +1183,57 @@ static HRESULT __stdcall _SetClipper(IDirectDrawSurfaceImpl *this, LPDIRECTDRAWC
     return ret;
 }
 
-HRESULT __stdcall _SetColorKey(IDirectDrawSurfaceImpl *this, DWORD a, LPDDCOLORKEY b)
+static HRESULT __stdcall _SetColorKey(IDirectDrawSurfaceImpl *this, DWORD dwFlags, LPDDCOLORKEY lpDDColorKey)
 {
-    dprintf("IDirectDrawSurface::SetColorKey(this=%p, ...)\n", this);
-    return DD_OK;
+    ENTER;
+    dprintf("--> IDirectDrawSurface::SetColorKey(this=%p, dwFlags=%08X, lpDDColorKey=%p)\n", this, (int)dwFlags, lpDDColorKey);
+
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_SetColorKey(this->real, dwFlags, lpDDColorKey);
+    }
+    else
+    {
+        // overlay keys are accepted but never used, only blits are keyed
+        EnterCriticalSection(&this->lock);
+
+        this->spans.valid = false;
+
+        if (dwFlags & DDCKEY_SRCBLT)
+        {
+            if (lpDDColorKey)
+            {
+                this->srcColorKey = *lpDDColorKey;
+                this->colorKeyFlags |= DDCKEY_SRCBLT;
+            }
+            else
+                this->colorKeyFlags &= ~DDCKEY_SRCBLT;
+        }
+
+        if (dwFlags & DDCKEY_DESTBLT)
+        {
+            if (lpDDColorKey)
+            {
+                this->destColorKey = *lpDDColorKey;
+                this->colorKeyFlags |= DDCKEY_DESTBLT;
+            }
+            else
+                this->colorKeyFlags &= ~DDCKEY_DESTBLT;
+        }
+
+        LeaveCriticalSection(&this->lock);
+
+        if (VERBOSE && lpDDColorKey)
+        {
+            dprintf(" key: low: %08X high: %08X\n", (int)lpDDColorKey->dwColorSpaceLowValue, (int)lpDDColorKey->dwColorSpaceHighValue);
+        }
+    }
+
+    dprintf("<-- IDirectDrawSurface::SetColorKey(this=%p, dwFlags=%08X, lpDDColorKey=%p) -> %08X\n", this, (int)dwFlags, lpDDColorKey, (int)ret);
+    LEAVE;
+    return ret;
 }
 
 HRESULT __stdcall _SetOverlayPosition(IDirectDrawSurfaceImpl *this, LONG a, LONG b)
@@ -725,8 +1261,13 @@ static HRESULT __stdcall _Unlock(IDirectDrawSurfaceImpl *this, LPVOID lpRect)
     }
     else
     {
-        LeaveCriticalSection(&this->lock);
+        // anything built while the surface was locked may have seen a half written frame
+        this->spans.valid = false;
 
+        if (this->locks > 0)
+            this->locks--;
+
+        LeaveCriticalSection(&this->lock);
     }
 
     dprintf("<-- IDirectDrawSurface::Unlock(this=%p, lpRect=%p) -> %08X\n", this, lpRect, (int)ret);
@@ -19,8 +19,9 @@
 #include "ddraw.h"
 #include "main.h"
 #include "IDirectDraw.h"
+#include "blit.h"
+#include "dirty.h"
 
-#define FRAME_SAMPLES 30
 #define WM_SWITCHRENDERER WM_USER+112
 
 typedef struct IDirectDrawSurfaceImplVtbl IDirectDrawSurfaceImplVtbl;
@@ -43,6 +44,10 @@ struct IDirectDrawSurfaceImpl
     DWORD dwFlags;
     DWORD dwCaps;
 
+    DWORD colorKeyFlags;
+    DDCOLORKEY srcColorKey;
+    DDCOLORKEY destColorKey;
+
     unsigned short *surface;
     DDSURFACEDESC desc;
     PBITMAPINFO bmi;
@@ -63,12 +68,26 @@ struct IDirectDrawSurfaceImpl
     BOOL usingPBO;
     int pboCount;
     GLuint *pbo;
+    GLsync *pboFences;
+    DirtyRegion *pboStale;
     int pboIndex;
     void *systemSurface;
     void *pboSurface;
+    BOOL usingPersistent;
+    uint8_t *persistentSurface;
+    void *watchSurface;
+    PVOID *watchPages;
+    ULONG_PTR watchPageCount;
     GLuint textures[2];
     int textureWidth;
     int textureHeight;
+    GLenum textureTarget;
+
+    BlitStretchCache stretchCache;
+    BlitSpanTable spans;
+    // Lock calls not yet matched by Unlock, only changed while holding lock
+    int locks;
+    DirtyRegion dirty;
 };
 
 struct IDirectDrawSurfaceImplVtbl
@@ -24,9 +24,24 @@ void SettingsLoad()
 
     PrimarySurface2Tex = GetBool("PrimarySurface2Tex", PrimarySurface2Tex);
     GlFinish = GetBool("GlFinish", GlFinish);
+    MaxFramesInFlight = GetInt("MaxFramesInFlight", MaxFramesInFlight);
     ConvertOnGPU = GetBool("ConvertOnGPU", true);
+    ForceProbe = GetBool("ForceProbe", ForceProbe);
+    AsyncRenderer = GetBool("AsyncRenderer", AsyncRenderer);
+    SuspendHidden = GetBool("SuspendHidden", SuspendHidden);
+    BilinearBlt = GetBool("BilinearBlt", BilinearBlt);
+    GdiBlt = GetBool("GdiBlt", GdiBlt);
+    DirtyRectThreshold = GetInt("DirtyRectThreshold", DirtyRectThreshold);
+    WriteWatch = GetBool("WriteWatch", WriteWatch);
+    TileDiffing = GetBool("TileDiffing", TileDiffing);
+    PersistentPBO = GetBool("PersistentPBO", PersistentPBO);
 
     TargetFPS = (double)GetInt("TargetFPS", (int)TargetFPS);
+
+    // TargetFPS=0 presents whenever the game finishes a frame, at most once per display refresh
+    if (( SyncToGame = TargetFPS <= 0 ))
+        TargetFPS = 60.0;
+
     TargetFrameLen = 1000.0 / TargetFPS;
 
     if (GetBool("VSync", false))
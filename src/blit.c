@@ -0,0 +1,1047 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include "blit.h"
+
+#ifdef __GNUC__
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static void Fill16_SSE2(void *dst, int dstPitch, int width, int height, uint16_t color, bool stream);
+static void Copy16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height);
+static void CopyReverse16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height);
+static void CopyKeySrc16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key);
+static void CopyKeyDest16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key);
+
+static void (*Fill16)(void *, int, int, int, uint16_t, bool) = Fill16_SSE2;
+static void (*Copy16)(void *, int, const void *, int, int, int) = Copy16_SSE2;
+static void (*CopyReverse16)(void *, int, const void *, int, int, int) = CopyReverse16_SSE2;
+static void (*CopyKeySrc16)(void *, int, const void *, int, int, int, uint16_t) = CopyKeySrc16_SSE2;
+static void (*CopyKeyDest16)(void *, int, const void *, int, int, int, uint16_t) = CopyKeyDest16_SSE2;
+
+static bool CpuHasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // AVX and OSXSAVE, the OS has to save the ymm registers for us
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return false;
+
+    if ((_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+
+    __cpuid(1, a, b, c, d);
+    if ((c & bit_OSXSAVE) == 0 || (c & bit_AVX) == 0)
+        return false;
+
+    __asm__ __volatile__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6)
+        return false;
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) != 0;
+#endif
+}
+
+static void Fill16_SSE2(void *dst, int dstPitch, int width, int height, uint16_t color, bool stream)
+{
+    __m128i v = _mm_set1_epi16((short)color);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *p = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        int n = width;
+
+        if (((uintptr_t)p & 1) == 0)
+        {
+            while (n > 0 && ((uintptr_t)p & 15))
+            {
+                *p++ = color;
+                n--;
+            }
+
+            if (stream)
+            {
+                for (; n >= 8; n -= 8, p += 8)
+                    _mm_stream_si128((__m128i *)p, v);
+            }
+            else
+            {
+                for (; n >= 32; n -= 32, p += 32)
+                {
+                    _mm_store_si128((__m128i *)p, v);
+                    _mm_store_si128((__m128i *)p + 1, v);
+                    _mm_store_si128((__m128i *)p + 2, v);
+                    _mm_store_si128((__m128i *)p + 3, v);
+                }
+
+                for (; n >= 8; n -= 8, p += 8)
+                    _mm_store_si128((__m128i *)p, v);
+            }
+        }
+        else
+        {
+            for (; n >= 8; n -= 8, p += 8)
+                _mm_storeu_si128((__m128i *)p, v);
+        }
+
+        while (n-- > 0)
+            *p++ = color;
+    }
+
+    if (stream)
+        _mm_sfence();
+}
+
+TARGET_AVX2 static void Fill16_AVX2(void *dst, int dstPitch, int width, int height, uint16_t color, bool stream)
+{
+    __m256i v = _mm256_set1_epi16((short)color);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *p = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        int n = width;
+
+        if (((uintptr_t)p & 1) == 0)
+        {
+            while (n > 0 && ((uintptr_t)p & 31))
+            {
+                *p++ = color;
+                n--;
+            }
+
+            if (stream)
+            {
+                for (; n >= 16; n -= 16, p += 16)
+                    _mm256_stream_si256((__m256i *)p, v);
+            }
+            else
+            {
+                for (; n >= 64; n -= 64, p += 64)
+                {
+                    _mm256_store_si256((__m256i *)p, v);
+                    _mm256_store_si256((__m256i *)p + 1, v);
+                    _mm256_store_si256((__m256i *)p + 2, v);
+                    _mm256_store_si256((__m256i *)p + 3, v);
+                }
+
+                for (; n >= 16; n -= 16, p += 16)
+                    _mm256_store_si256((__m256i *)p, v);
+            }
+        }
+        else
+        {
+            for (; n >= 16; n -= 16, p += 16)
+                _mm256_storeu_si256((__m256i *)p, v);
+        }
+
+        while (n-- > 0)
+            *p++ = color;
+    }
+
+    if (stream)
+        _mm_sfence();
+}
+
+static void Copy16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        // pull in the next source row while this one is copied
+        if (y + 1 < height)
+            _mm_prefetch((const char *)s + srcPitch, _MM_HINT_T0);
+
+        if (((uintptr_t)d & 1) == 0)
+        {
+            while (n > 0 && ((uintptr_t)d & 15))
+            {
+                *d++ = *s++;
+                n--;
+            }
+
+            for (; n >= 32; n -= 32, d += 32, s += 32)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i *)s);
+                __m128i b = _mm_loadu_si128((const __m128i *)s + 1);
+                __m128i c = _mm_loadu_si128((const __m128i *)s + 2);
+                __m128i e = _mm_loadu_si128((const __m128i *)s + 3);
+                _mm_store_si128((__m128i *)d, a);
+                _mm_store_si128((__m128i *)d + 1, b);
+                _mm_store_si128((__m128i *)d + 2, c);
+                _mm_store_si128((__m128i *)d + 3, e);
+            }
+
+            for (; n >= 8; n -= 8, d += 8, s += 8)
+                _mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        }
+        else
+        {
+            for (; n >= 8; n -= 8, d += 8, s += 8)
+                _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        }
+
+        while (n-- > 0)
+            *d++ = *s++;
+    }
+}
+
+TARGET_AVX2 static void Copy16_AVX2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        if (y + 1 < height)
+            _mm_prefetch((const char *)s + srcPitch, _MM_HINT_T0);
+
+        if (((uintptr_t)d & 1) == 0)
+        {
+            while (n > 0 && ((uintptr_t)d & 31))
+            {
+                *d++ = *s++;
+                n--;
+            }
+
+            for (; n >= 64; n -= 64, d += 64, s += 64)
+            {
+                __m256i a = _mm256_loadu_si256((const __m256i *)s);
+                __m256i b = _mm256_loadu_si256((const __m256i *)s + 1);
+                __m256i c = _mm256_loadu_si256((const __m256i *)s + 2);
+                __m256i e = _mm256_loadu_si256((const __m256i *)s + 3);
+                _mm256_store_si256((__m256i *)d, a);
+                _mm256_store_si256((__m256i *)d + 1, b);
+                _mm256_store_si256((__m256i *)d + 2, c);
+                _mm256_store_si256((__m256i *)d + 3, e);
+            }
+
+            for (; n >= 16; n -= 16, d += 16, s += 16)
+                _mm256_store_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        }
+        else
+        {
+            for (; n >= 16; n -= 16, d += 16, s += 16)
+                _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        }
+
+        while (n-- > 0)
+            *d++ = *s++;
+    }
+}
+
+static void CopyReverse16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch) + width;
+        int n = width;
+
+        // walk the source backwards and swap the 8 lanes of every vector
+        for (; n >= 8; n -= 8, d += 8)
+        {
+            s -= 8;
+
+            __m128i v = _mm_loadu_si128((const __m128i *)s);
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128((__m128i *)d, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        }
+
+        while (n-- > 0)
+            *d++ = *--s;
+    }
+}
+
+TARGET_AVX2 static void CopyReverse16_AVX2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height)
+{
+    const __m256i reverse = _mm256_setr_epi8(
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch) + width;
+        int n = width;
+
+        for (; n >= 16; n -= 16, d += 16)
+        {
+            s -= 16;
+
+            __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)s), reverse);
+            _mm256_storeu_si256((__m256i *)d, _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        }
+
+        while (n-- > 0)
+            *d++ = *--s;
+    }
+}
+
+static void CopyKeySrc16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    __m128i k = _mm_set1_epi16((short)key);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        if (y + 1 < height)
+            _mm_prefetch((const char *)s + srcPitch, _MM_HINT_T0);
+
+        // transparent lanes keep the destination, no branches per pixel
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+        {
+            __m128i s0 = _mm_loadu_si128((const __m128i *)s);
+            __m128i s1 = _mm_loadu_si128((const __m128i *)s + 1);
+            __m128i m0 = _mm_cmpeq_epi16(s0, k);
+            __m128i m1 = _mm_cmpeq_epi16(s1, k);
+            __m128i d0 = _mm_loadu_si128((const __m128i *)d);
+            __m128i d1 = _mm_loadu_si128((const __m128i *)d + 1);
+            _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_and_si128(m0, d0), _mm_andnot_si128(m0, s0)));
+            _mm_storeu_si128((__m128i *)d + 1, _mm_or_si128(_mm_and_si128(m1, d1), _mm_andnot_si128(m1, s1)));
+        }
+
+        for (; n >= 8; n -= 8, d += 8, s += 8)
+        {
+            __m128i sv = _mm_loadu_si128((const __m128i *)s);
+            __m128i m = _mm_cmpeq_epi16(sv, k);
+            __m128i dv = _mm_loadu_si128((const __m128i *)d);
+            _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_and_si128(m, dv), _mm_andnot_si128(m, sv)));
+        }
+
+        for (; n > 0; n--, d++, s++)
+        {
+            if (*s != key)
+                *d = *s;
+        }
+    }
+}
+
+TARGET_AVX2 static void CopyKeySrc16_AVX2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    __m256i k = _mm256_set1_epi16((short)key);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        if (y + 1 < height)
+            _mm_prefetch((const char *)s + srcPitch, _MM_HINT_T0);
+
+        for (; n >= 32; n -= 32, d += 32, s += 32)
+        {
+            __m256i s0 = _mm256_loadu_si256((const __m256i *)s);
+            __m256i s1 = _mm256_loadu_si256((const __m256i *)s + 1);
+            __m256i d0 = _mm256_loadu_si256((const __m256i *)d);
+            __m256i d1 = _mm256_loadu_si256((const __m256i *)d + 1);
+            _mm256_storeu_si256((__m256i *)d, _mm256_blendv_epi8(s0, d0, _mm256_cmpeq_epi16(s0, k)));
+            _mm256_storeu_si256((__m256i *)d + 1, _mm256_blendv_epi8(s1, d1, _mm256_cmpeq_epi16(s1, k)));
+        }
+
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+        {
+            __m256i sv = _mm256_loadu_si256((const __m256i *)s);
+            __m256i dv = _mm256_loadu_si256((const __m256i *)d);
+            _mm256_storeu_si256((__m256i *)d, _mm256_blendv_epi8(sv, dv, _mm256_cmpeq_epi16(sv, k)));
+        }
+
+        for (; n > 0; n--, d++, s++)
+        {
+            if (*s != key)
+                *d = *s;
+        }
+    }
+}
+
+static void CopyKeyDest16_SSE2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    __m128i k = _mm_set1_epi16((short)key);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        if (y + 1 < height)
+            _mm_prefetch((const char *)s + srcPitch, _MM_HINT_T0);
+
+        // only lanes where the destination holds the key take the source
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+        {
+            __m128i d0 = _mm_loadu_si128((const __m128i *)d);
+            __m128i d1 = _mm_loadu_si128((const __m128i *)d + 1);
+            __m128i m0 = _mm_cmpeq_epi16(d0, k);
+            __m128i m1 = _mm_cmpeq_epi16(d1, k);
+            __m128i s0 = _mm_loadu_si128((const __m128i *)s);
+            __m128i s1 = _mm_loadu_si128((const __m128i *)s + 1);
+            _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_and_si128(m0, s0), _mm_andnot_si128(m0, d0)));
+            _mm_storeu_si128((__m128i *)d + 1, _mm_or_si128(_mm_and_si128(m1, s1), _mm_andnot_si128(m1, d1)));
+        }
+
+        for (; n >= 8; n -= 8, d += 8, s += 8)
+        {
+            __m128i dv = _mm_loadu_si128((const __m128i *)d);
+            __m128i m = _mm_cmpeq_epi16(dv, k);
+            __m128i sv = _mm_loadu_si128((const __m128i *)s);
+            _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_and_si128(m, sv), _mm_andnot_si128(m, dv)));
+        }
+
+        for (; n > 0; n--, d++, s++)
+        {
+            if (*d == key)
+                *d = *s;
+        }
+    }
+}
+
+TARGET_AVX2 static void CopyKeyDest16_AVX2(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    __m256i k = _mm256_set1_epi16((short)key);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        if (y + 1 < height)
+            _mm_prefetch((const char *)s + srcPitch, _MM_HINT_T0);
+
+        for (; n >= 32; n -= 32, d += 32, s += 32)
+        {
+            __m256i d0 = _mm256_loadu_si256((const __m256i *)d);
+            __m256i d1 = _mm256_loadu_si256((const __m256i *)d + 1);
+            __m256i s0 = _mm256_loadu_si256((const __m256i *)s);
+            __m256i s1 = _mm256_loadu_si256((const __m256i *)s + 1);
+            _mm256_storeu_si256((__m256i *)d, _mm256_blendv_epi8(d0, s0, _mm256_cmpeq_epi16(d0, k)));
+            _mm256_storeu_si256((__m256i *)d + 1, _mm256_blendv_epi8(d1, s1, _mm256_cmpeq_epi16(d1, k)));
+        }
+
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+        {
+            __m256i dv = _mm256_loadu_si256((const __m256i *)d);
+            __m256i sv = _mm256_loadu_si256((const __m256i *)s);
+            _mm256_storeu_si256((__m256i *)d, _mm256_blendv_epi8(dv, sv, _mm256_cmpeq_epi16(dv, k)));
+        }
+
+        for (; n > 0; n--, d++, s++)
+        {
+            if (*d == key)
+                *d = *s;
+        }
+    }
+}
+
+void Blit_Init()
+{
+    static bool initialized = false;
+
+    if (initialized)
+        return;
+
+    initialized = true;
+    Blit_UseAVX2(true);
+}
+
+bool Blit_UseAVX2(bool enable)
+{
+    enable = enable && CpuHasAVX2();
+
+    Fill16 = enable ? Fill16_AVX2 : Fill16_SSE2;
+    Copy16 = enable ? Copy16_AVX2 : Copy16_SSE2;
+    CopyReverse16 = enable ? CopyReverse16_AVX2 : CopyReverse16_SSE2;
+    CopyKeySrc16 = enable ? CopyKeySrc16_AVX2 : CopyKeySrc16_SSE2;
+    CopyKeyDest16 = enable ? CopyKeyDest16_AVX2 : CopyKeyDest16_SSE2;
+
+    return enable;
+}
+
+void Blit_Fill16(void *dst, int dstPitch, int width, int height, uint16_t color, bool stream)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    Fill16(dst, dstPitch, width, height, color, stream);
+}
+
+void Blit_Copy16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    Copy16(dst, dstPitch, src, srcPitch, width, height);
+}
+
+void Blit_CopyMirror16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, int mirror)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    if (mirror & BLIT_MIRROR_Y)
+    {
+        src = (const uint8_t *)src + (height - 1) * srcPitch;
+        srcPitch = -srcPitch;
+    }
+
+    if (mirror & BLIT_MIRROR_X)
+        CopyReverse16(dst, dstPitch, src, srcPitch, width, height);
+    else
+        Copy16(dst, dstPitch, src, srcPitch, width, height);
+}
+
+void Blit_Move16(void *dst, const void *src, int pitch, int width, int height)
+{
+    if (width <= 0 || height <= 0 || dst == src)
+        return;
+
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    ptrdiff_t distance = d > s ? d - s : s - d;
+
+    // scrolling down starts at the bottom so every row is read before it gets overwritten
+    if (d > s)
+    {
+        d += (height - 1) * pitch;
+        s += (height - 1) * pitch;
+        pitch = -pitch;
+    }
+
+    if (distance < width * 2)
+    {
+        // horizontal scroll, source and destination share the row
+        for (int y = 0; y < height; y++, d += pitch, s += pitch)
+            memmove(d, s, width * 2);
+    }
+    else
+    {
+        Copy16(d, pitch, s, pitch, width, height);
+    }
+}
+
+void Blit_CopyKeySrc16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    CopyKeySrc16(dst, dstPitch, src, srcPitch, width, height, key);
+}
+
+void Blit_CopyKeyDest16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    CopyKeyDest16(dst, dstPitch, src, srcPitch, width, height, key);
+}
+
+#define HASH_MUL 0x9E3779B1u
+
+// Low halves of a 32 bit multiply per lane, SSE2 only multiplies the even lanes
+static inline __m128i MulLo32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i HashMix(__m128i h, __m128i v, __m128i mul)
+{
+    h = MulLo32(_mm_xor_si128(h, v), mul);
+    return _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+}
+
+static inline uint32_t HashMixScalar(uint32_t h, uint32_t v)
+{
+    h = (h ^ v) * HASH_MUL;
+    return h ^ (h >> 15);
+}
+
+uint64_t Blit_Hash16(const void *src, int srcPitch, int width, int height)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul = _mm_set1_epi32((int)HASH_MUL);
+    __m128i lo = _mm_setr_epi32(1, 2, 3, 4);
+    __m128i hi = _mm_setr_epi32(5, 6, 7, 8);
+    uint32_t tail = 9;
+
+    // Every lane runs its pixels through a multiply and xorshift, each step is a bijection so a single changed
+    // pixel always changes the hash and changes that cancel out in a sum don't cancel here
+    for (int y = 0; y < height; y++)
+    {
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        for (; n >= 8; n -= 8, s += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)s);
+
+            lo = HashMix(lo, _mm_unpacklo_epi16(v, zero), mul);
+            hi = HashMix(hi, _mm_unpackhi_epi16(v, zero), mul);
+        }
+
+        while (n-- > 0)
+            tail = HashMixScalar(tail, *s++);
+    }
+
+    uint32_t lanes[9];
+    _mm_storeu_si128((__m128i *)lanes, lo);
+    _mm_storeu_si128((__m128i *)lanes + 1, hi);
+    lanes[8] = tail;
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (int i = 0; i < 9; i++)
+    {
+        hash ^= lanes[i];
+        hash *= 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+static inline uint32_t Convert565To8888(uint16_t px)
+{
+    uint32_t r = px >> 11;
+    uint32_t g = (px >> 5) & 63;
+    uint32_t b = px & 31;
+
+    return ((r << 3) | (r >> 2)) | (((g << 2) | (g >> 4)) << 8) | (((b << 3) | (b >> 2)) << 16) | 0xFF000000;
+}
+
+void Blit_Convert565To8888(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height)
+{
+    const __m128i mask5 = _mm_set1_epi16(31);
+    const __m128i mask6 = _mm_set1_epi16(63);
+    const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+
+    for (int y = 0; y < height; y++)
+    {
+        uint32_t *d = (uint32_t *)((uint8_t *)dst + y * dstPitch);
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+        int n = width;
+
+        // widen every channel to 8 bits by replicating its top bits, output bytes are R, G, B, A
+        for (; n >= 8; n -= 8, d += 8, s += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)s);
+            __m128i r = _mm_srli_epi16(v, 11);
+            __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+            __m128i b = _mm_and_si128(v, mask5);
+
+            r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+            g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+            b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+            __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+            __m128i ba = _mm_or_si128(b, alpha);
+
+            _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(rg, ba));
+            _mm_storeu_si128((__m128i *)d + 1, _mm_unpackhi_epi16(rg, ba));
+        }
+
+        while (n-- > 0)
+            *d++ = Convert565To8888(*s++);
+    }
+}
+
+static BlitStretchTable *StretchTable(BlitStretchCache *cache, int srcW, int srcH, int dstW, int dstH, bool bilinear)
+{
+    BlitStretchTable *table = &cache->tables[0];
+
+    cache->clock++;
+
+    for (int i = 0; i < BLIT_STRETCH_CACHE; i++)
+    {
+        BlitStretchTable *t = &cache->tables[i];
+
+        if (t->cols && t->srcW == srcW && t->srcH == srcH && t->dstW == dstW && t->dstH == dstH
+            && t->bilinear == bilinear)
+        {
+            t->lastUsed = cache->clock;
+            return t;
+        }
+
+        if (!t->cols || t->lastUsed < table->lastUsed)
+            table = t;
+    }
+
+    // replace the least recently used entry
+    free(table->cols);
+    free(table->rows);
+
+    table->cols = malloc(dstW * sizeof(int32_t));
+    table->rows = malloc(dstH * sizeof(int32_t));
+
+    if (!table->cols || !table->rows)
+    {
+        free(table->cols);
+        free(table->rows);
+        table->cols = NULL;
+        table->rows = NULL;
+        return NULL;
+    }
+
+    table->srcW = srcW;
+    table->srcH = srcH;
+    table->dstW = dstW;
+    table->dstH = dstH;
+    table->bilinear = bilinear;
+    table->lastUsed = cache->clock;
+
+    int sizes[2][2] = { { srcW, dstW }, { srcH, dstH } };
+    int32_t *steps[2] = { table->cols, table->rows };
+
+    for (int axis = 0; axis < 2; axis++)
+    {
+        int s = sizes[axis][0];
+        int d = sizes[axis][1];
+        int64_t step = ((int64_t)s << 16) / d;
+        int64_t pos = step / 2;
+        int64_t last = (int64_t)(s - 1) << 16;
+
+        // bilinear samples between texel centers, nearest picks the texel under the center
+        if (bilinear)
+            pos -= 0x8000;
+
+        for (int i = 0; i < d; i++, pos += step)
+        {
+            int64_t p = bilinear ? pos : (pos & ~0xFFFF);
+
+            if (p < 0)
+                p = 0;
+
+            if (p > last)
+                p = last;
+
+            steps[axis][i] = (int32_t)p;
+        }
+    }
+
+    return table;
+}
+
+static inline uint32_t Spread565(uint16_t px)
+{
+    return (px | ((uint32_t)px << 16)) & 0x07E0F81F;
+}
+
+static inline uint16_t Pack565(uint32_t spread)
+{
+    spread &= 0x07E0F81F;
+    return (uint16_t)(spread | (spread >> 16));
+}
+
+static void StretchRowNearest(uint16_t *dst, const uint16_t *src, const int32_t *cols, int count)
+{
+    int x = 0;
+
+    for (; x + 4 <= count; x += 4)
+    {
+        dst[x] = src[cols[x] >> 16];
+        dst[x + 1] = src[cols[x + 1] >> 16];
+        dst[x + 2] = src[cols[x + 2] >> 16];
+        dst[x + 3] = src[cols[x + 3] >> 16];
+    }
+
+    for (; x < count; x++)
+        dst[x] = src[cols[x] >> 16];
+}
+
+static void StretchRowNearestKeySrc(uint16_t *dst, const uint16_t *src, const int32_t *cols, int count, uint16_t key)
+{
+    for (int x = 0; x < count; x++)
+    {
+        uint16_t px = src[cols[x] >> 16];
+
+        if (px != key)
+            dst[x] = px;
+    }
+}
+
+static void StretchRowNearestKeyDest(uint16_t *dst, const uint16_t *src, const int32_t *cols, int count, uint16_t key)
+{
+    for (int x = 0; x < count; x++)
+    {
+        if (dst[x] == key)
+            dst[x] = src[cols[x] >> 16];
+    }
+}
+
+static void StretchRowBilinear(uint16_t *dst, const uint16_t *src0, const uint16_t *src1, int srcW,
+                               const int32_t *cols, int count, uint32_t wy)
+{
+    for (int x = 0; x < count; x++)
+    {
+        int sx = cols[x] >> 16;
+        int sx1 = sx + 1 < srcW ? sx + 1 : sx;
+        uint32_t wx = (cols[x] >> 11) & 31;
+
+        // 5 bit weights leave enough headroom in every spread 565 field
+        uint32_t top = (Spread565(src0[sx]) * (32 - wx) + Spread565(src0[sx1]) * wx) >> 5;
+        uint32_t bottom = (Spread565(src1[sx]) * (32 - wx) + Spread565(src1[sx1]) * wx) >> 5;
+
+        top &= 0x07E0F81F;
+        bottom &= 0x07E0F81F;
+
+        dst[x] = Pack565((top * (32 - wy) + bottom * wy) >> 5);
+    }
+}
+
+static void Stretch16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                      const void *src, int srcPitch, int srcW, int srcH, bool bilinear, const uint16_t *srcKey,
+                      const uint16_t *destKey, int mirror)
+{
+    if (dstW <= 0 || dstH <= 0 || srcW <= 0 || srcH <= 0 || visible->w <= 0 || visible->h <= 0)
+        return;
+
+    BlitStretchTable *table = StretchTable(cache, srcW, srcH, dstW, dstH, bilinear);
+    if (!table)
+        return;
+
+    const int32_t *cols = table->cols + visible->x;
+    int32_t *mirrored = NULL;
+
+    if (mirror & BLIT_MIRROR_X)
+    {
+        mirrored = malloc(visible->w * sizeof(int32_t));
+        if (!mirrored)
+            return;
+
+        for (int x = 0; x < visible->w; x++)
+            mirrored[x] = table->cols[dstW - 1 - visible->x - x];
+
+        cols = mirrored;
+    }
+
+    int32_t prevRow = -1;
+    uint8_t *prevDst = NULL;
+
+    for (int y = 0; y < visible->h; y++)
+    {
+        int dy = visible->y + y;
+        int32_t row = table->rows[(mirror & BLIT_MIRROR_Y) ? dstH - 1 - dy : dy];
+        uint16_t *d = (uint16_t *)((uint8_t *)dst + y * dstPitch);
+
+        if (row == prevRow && !srcKey && !destKey)
+        {
+            // upscaled rows repeat, reuse what we already produced
+            memcpy(d, prevDst, visible->w * 2);
+            continue;
+        }
+
+        int sy = row >> 16;
+        const uint16_t *s0 = (const uint16_t *)((const uint8_t *)src + sy * srcPitch);
+
+        if (srcKey)
+        {
+            StretchRowNearestKeySrc(d, s0, cols, visible->w, *srcKey);
+        }
+        else if (destKey)
+        {
+            StretchRowNearestKeyDest(d, s0, cols, visible->w, *destKey);
+        }
+        else if (bilinear)
+        {
+            const uint16_t *s1 = sy + 1 < srcH ? (const uint16_t *)((const uint8_t *)s0 + srcPitch) : s0;
+            StretchRowBilinear(d, s0, s1, srcW, cols, visible->w, (row >> 11) & 31);
+        }
+        else
+        {
+            StretchRowNearest(d, s0, cols, visible->w);
+        }
+
+        prevRow = row;
+        prevDst = (uint8_t *)d;
+    }
+
+    free(mirrored);
+}
+
+void Blit_Stretch16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                    const void *src, int srcPitch, int srcW, int srcH, bool bilinear, int mirror)
+{
+    Stretch16(cache, dst, dstPitch, dstW, dstH, visible, src, srcPitch, srcW, srcH, bilinear, NULL, NULL, mirror);
+}
+
+void Blit_StretchKeySrc16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                          const void *src, int srcPitch, int srcW, int srcH, uint16_t key, int mirror)
+{
+    // filtering would blend the key color into the edges, keyed stretches always sample nearest
+    Stretch16(cache, dst, dstPitch, dstW, dstH, visible, src, srcPitch, srcW, srcH, false, &key, NULL, mirror);
+}
+
+void Blit_StretchKeyDest16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                           const void *src, int srcPitch, int srcW, int srcH, uint16_t key, int mirror)
+{
+    Stretch16(cache, dst, dstPitch, dstW, dstH, visible, src, srcPitch, srcW, srcH, false, NULL, &key, mirror);
+}
+
+// Trims a Blt source rectangle to its surface and tells whether the blit then has to go through the stretch
+// kernels. Those share the destination's step tables, so callers splitting work across threads need to know
+bool Blit_TrimSource(BlitRect *src, int surfaceW, int surfaceH, int dstW, int dstH, int mirror, bool keyed)
+{
+    if (src->x + src->w > surfaceW)
+        src->w = surfaceW - src->x;
+
+    if (src->y + src->h > surfaceH)
+        src->h = surfaceH - src->y;
+
+    // keyed mirrors sample through the nearest stretch, it reads every pixel exactly once
+    return src->w != dstW || src->h != dstH || (mirror && keyed);
+}
+
+void Blit_FreeStretchCache(BlitStretchCache *cache)
+{
+    for (int i = 0; i < BLIT_STRETCH_CACHE; i++)
+    {
+        free(cache->tables[i].cols);
+        free(cache->tables[i].rows);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+}
+
+void Blit_BuildSpans16(BlitSpanTable *table, const void *src, int srcPitch, int width, int height, uint16_t key)
+{
+    table->valid = false;
+
+    if (width <= 0 || height <= 0 || width > 0xFFFF)
+        return;
+
+    if (table->height != height || !table->rows)
+    {
+        free(table->rows);
+        table->rows = malloc((height + 1) * sizeof(int));
+
+        if (!table->rows)
+            return;
+    }
+
+    int count = 0;
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + y * srcPitch);
+
+        table->rows[y] = count;
+
+        for (int x = 0; x < width;)
+        {
+            while (x < width && s[x] == key)
+                x++;
+
+            if (x == width)
+                break;
+
+            int start = x;
+
+            while (x < width && s[x] != key)
+                x++;
+
+            if (count == table->capacity)
+            {
+                int capacity = table->capacity ? table->capacity * 2 : 256;
+                BlitSpan *spans = realloc(table->spans, capacity * sizeof(BlitSpan));
+
+                if (!spans)
+                    return;
+
+                table->spans = spans;
+                table->capacity = capacity;
+            }
+
+            table->spans[count].x = (uint16_t)start;
+            table->spans[count].length = (uint16_t)(x - start);
+            count++;
+        }
+    }
+
+    table->rows[height] = count;
+    table->width = width;
+    table->height = height;
+    table->key = key;
+    table->valid = true;
+
+    // short runs cost more in memcpy calls than the masked copy spends on the whole row
+    table->sparse = (int64_t)count * 16 <= (int64_t)width * height;
+}
+
+void Blit_CopySpans16(const BlitSpanTable *table, void *dst, int dstPitch, const void *src, int srcPitch,
+                      int srcX, int srcY, int width, int height)
+{
+    int right = srcX + width;
+
+    for (int y = 0; y < height; y++)
+    {
+        int sy = srcY + y;
+        uint8_t *d = (uint8_t *)dst + y * dstPitch;
+        const uint16_t *s = (const uint16_t *)((const uint8_t *)src + sy * srcPitch);
+
+        for (int i = table->rows[sy]; i < table->rows[sy + 1]; i++)
+        {
+            int x0 = table->spans[i].x;
+            int x1 = x0 + table->spans[i].length;
+
+            if (x1 <= srcX)
+                continue;
+
+            if (x0 >= right)
+                break;
+
+            if (x0 < srcX)
+                x0 = srcX;
+
+            if (x1 > right)
+                x1 = right;
+
+            memcpy(d + (x0 - srcX) * 2, s + x0, (x1 - x0) * 2);
+        }
+    }
+}
+
+void Blit_FreeSpans(BlitSpanTable *table)
+{
+    free(table->rows);
+    free(table->spans);
+
+    memset(table, 0, sizeof(*table));
+}
@@ -0,0 +1,85 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLIT_STRETCH_CACHE 4
+
+#define BLIT_MIRROR_X 1
+#define BLIT_MIRROR_Y 2
+
+typedef struct
+{
+    int x;
+    int y;
+    int w;
+    int h;
+} BlitRect;
+
+typedef struct
+{
+    int srcW;
+    int srcH;
+    int dstW;
+    int dstH;
+    bool bilinear;
+    unsigned int lastUsed;
+    // 16.16 fixed point source positions for every destination column and row
+    int32_t *cols;
+    int32_t *rows;
+} BlitStretchTable;
+
+// Step tables are kept per destination surface so repeated stretches skip the setup
+typedef struct
+{
+    BlitStretchTable tables[BLIT_STRETCH_CACHE];
+    unsigned int clock;
+} BlitStretchCache;
+
+typedef struct
+{
+    uint16_t x;
+    uint16_t length;
+} BlitSpan;
+
+// Opaque runs of a color keyed surface, spans of row y are rows[y] .. rows[y + 1] - 1
+typedef struct
+{
+    bool valid;
+    bool sparse;
+    uint16_t key;
+    int width;
+    int height;
+    int capacity;
+    int *rows;
+    BlitSpan *spans;
+} BlitSpanTable;
+
+// Pixel kernels for 16bpp surfaces, pitch is always in bytes. Nothing in here depends on windows.h so the
+// kernels build and run on any SSE2 host
+void Blit_Init();
+// Switches between the SSE2 and AVX2 kernels, returns false when the CPU has no AVX2
+bool Blit_UseAVX2(bool enable);
+void Blit_Fill16(void *dst, int dstPitch, int width, int height, uint16_t color, bool stream);
+void Blit_Copy16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height);
+void Blit_CopyMirror16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, int mirror);
+void Blit_Move16(void *dst, const void *src, int pitch, int width, int height);
+void Blit_CopyKeySrc16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key);
+void Blit_CopyKeyDest16(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height, uint16_t key);
+uint64_t Blit_Hash16(const void *src, int srcPitch, int width, int height);
+void Blit_Convert565To8888(void *dst, int dstPitch, const void *src, int srcPitch, int width, int height);
+void Blit_Stretch16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                    const void *src, int srcPitch, int srcW, int srcH, bool bilinear, int mirror);
+void Blit_StretchKeySrc16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                          const void *src, int srcPitch, int srcW, int srcH, uint16_t key, int mirror);
+void Blit_StretchKeyDest16(BlitStretchCache *cache, void *dst, int dstPitch, int dstW, int dstH, const BlitRect *visible,
+                           const void *src, int srcPitch, int srcW, int srcH, uint16_t key, int mirror);
+void Blit_FreeStretchCache(BlitStretchCache *cache);
+bool Blit_TrimSource(BlitRect *src, int surfaceW, int surfaceH, int dstW, int dstH, int mirror, bool keyed);
+void Blit_BuildSpans16(BlitSpanTable *table, const void *src, int srcPitch, int width, int height, uint16_t key);
+void Blit_CopySpans16(const BlitSpanTable *table, void *dst, int dstPitch, const void *src, int srcPitch,
+                      int srcX, int srcY, int width, int height);
+void Blit_FreeSpans(BlitSpanTable *table);
+
+#endif
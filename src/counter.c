@@ -1,6 +1,9 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <mmsystem.h>
+#include <dwmapi.h>
 #include <stdio.h>
+#include <string.h>
 #include "counter.h"
 
 
@@ -21,3 +24,122 @@ double CounterGet(QPCounter *counterStartTime)
     QueryPerformanceCounter(&li);
     return (double)(li.QuadPart - *counterStartTime) / CounterFreq;
 }
+
+typedef HRESULT (WINAPI *DWMGETCOMPOSITIONTIMINGINFO)(HWND, DWM_TIMING_INFO *);
+
+// The last vblank the compositor saw and the refresh period, on the counter's clock. Fails without desktop
+// composition, dwmapi.dll is loaded at runtime so XP still starts
+bool CounterVblank(QPCounter *counterStartTime, double *vblank, double *period)
+{
+    static DWMGETCOMPOSITIONTIMINGINFO getTimingInfo = NULL;
+    static bool loaded = false;
+
+    if (!loaded)
+    {
+        loaded = true;
+
+        HMODULE dwm = LoadLibrary("dwmapi.dll");
+        if (dwm)
+            getTimingInfo = (DWMGETCOMPOSITIONTIMINGINFO)GetProcAddress(dwm, "DwmGetCompositionTimingInfo");
+    }
+
+    if (!getTimingInfo || CounterFreq <= 0)
+        return false;
+
+    DWM_TIMING_INFO info;
+    memset(&info, 0, sizeof(info));
+    info.cbSize = sizeof(info);
+
+    if (FAILED(getTimingInfo(NULL, &info)) || info.qpcRefreshPeriod == 0)
+        return false;
+
+    *vblank = (double)((LONGLONG)info.qpcVBlank - *counterStartTime) / CounterFreq;
+    *period = (double)info.qpcRefreshPeriod / CounterFreq;
+    return true;
+}
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+typedef HANDLE (WINAPI *CREATEWAITABLETIMEREXW)(LPSECURITY_ATTRIBUTES, LPCWSTR, DWORD, DWORD);
+
+// Spin margins in ms, the timer is asked to wake up this much early
+#define TIMER_MIN_MARGIN 0.1
+#define TIMER_MAX_MARGIN 2.0
+
+void FrameTimer_Init(FrameTimer *timer)
+{
+    CREATEWAITABLETIMEREXW createTimerEx =
+        (CREATEWAITABLETIMEREXW)GetProcAddress(GetModuleHandle("kernel32.dll"), "CreateWaitableTimerExW");
+
+    timer->timer = NULL;
+    timer->spinTime = 0.0;
+
+    if (createTimerEx)
+        timer->timer = createTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+    timer->highResolution = timer->timer != NULL;
+    timer->margin = TIMER_MIN_MARGIN;
+
+    if (!timer->highResolution)
+    {
+        // Windows before 10 1803 and Wine, the system timer resolution is raised while this timer exists
+        timeBeginPeriod(1);
+        timer->timer = CreateWaitableTimer(NULL, TRUE, NULL);
+        timer->margin = 1.0;
+    }
+}
+
+void FrameTimer_Free(FrameTimer *timer)
+{
+    if (timer->timer)
+        CloseHandle(timer->timer);
+
+    if (!timer->highResolution)
+        timeEndPeriod(1);
+
+    timer->timer = NULL;
+}
+
+// While nothing is paced the raised system timer resolution only costs power
+void FrameTimer_Suspend(FrameTimer *timer)
+{
+    if (!timer->highResolution)
+        timeEndPeriod(1);
+}
+
+void FrameTimer_Resume(FrameTimer *timer)
+{
+    if (!timer->highResolution)
+        timeBeginPeriod(1);
+}
+
+void FrameTimer_WaitUntil(FrameTimer *timer, QPCounter *counter, double ms)
+{
+    double remaining = ms - CounterGet(counter);
+
+    if (remaining > timer->margin)
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)((remaining - timer->margin) * 10000.0);
+
+        if (timer->timer && SetWaitableTimer(timer->timer, &due, 0, NULL, NULL, FALSE))
+            WaitForSingleObject(timer->timer, INFINITE);
+        else
+            Sleep((DWORD)(remaining - timer->margin));
+
+        // Calibrate the margin to how late the timer actually fires
+        double late = CounterGet(counter) - (ms - timer->margin);
+        double margin = timer->margin + (late * 1.5 - timer->margin) * 0.1;
+        timer->margin = margin < TIMER_MIN_MARGIN ? TIMER_MIN_MARGIN : margin > TIMER_MAX_MARGIN ? TIMER_MAX_MARGIN : margin;
+    }
+
+    double spinStart = CounterGet(counter);
+    double now = spinStart;
+
+    while (now < ms)
+        now = CounterGet(counter);
+
+    timer->spinTime = now - spinStart;
+}
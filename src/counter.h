@@ -1,6 +1,23 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <stdbool.h>
 
 typedef LONGLONG QPCounter;
 void CounterStart(QPCounter *counter);
 double CounterGet(QPCounter *counter);
+bool CounterVblank(QPCounter *counter, double *vblank, double *period);
+
+// Frame pacing, blocks on a waitable timer and only spins for what the timer can't resolve
+typedef struct
+{
+    HANDLE timer;
+    bool highResolution;
+    double margin;
+    double spinTime;
+} FrameTimer;
+
+void FrameTimer_Init(FrameTimer *timer);
+void FrameTimer_Free(FrameTimer *timer);
+void FrameTimer_WaitUntil(FrameTimer *timer, QPCounter *counter, double ms);
+void FrameTimer_Suspend(FrameTimer *timer);
+void FrameTimer_Resume(FrameTimer *timer);
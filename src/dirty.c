@@ -0,0 +1,185 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "dirty.h"
+#include "blit.h"
+
+
+static LONGLONG Area(const RECT *rc)
+{
+    return (LONGLONG)(rc->right - rc->left) * (rc->bottom - rc->top);
+}
+
+static bool Overlaps(const RECT *a, const RECT *b)
+{
+    return a->left < b->right && b->left < a->right && a->top < b->bottom && b->top < a->bottom;
+}
+
+void DirtyRegion_Init(DirtyRegion *region, int width, int height, int threshold)
+{
+    region->width = width;
+    region->height = height;
+    region->threshold = threshold;
+    DirtyRegion_SetFull(region);
+}
+
+void DirtyRegion_Reset(DirtyRegion *region)
+{
+    region->count = 0;
+    region->full = false;
+}
+
+void DirtyRegion_SetFull(DirtyRegion *region)
+{
+    region->count = 0;
+    region->full = true;
+}
+
+void DirtyRegion_Add(DirtyRegion *region, const RECT *rc)
+{
+    RECT bounds = { 0, 0, region->width, region->height };
+    RECT r;
+
+    if (region->full)
+        return;
+
+    if (!rc || region->threshold <= 0)
+    {
+        DirtyRegion_SetFull(region);
+        return;
+    }
+
+    if (!IntersectRect(&r, &bounds, rc))
+        return;
+
+    // swallow everything the new rect overlaps, the grown rect may reach ones already checked
+    for (int i = 0; i < region->count;)
+    {
+        if (Overlaps(&r, &region->rects[i]))
+        {
+            UnionRect(&r, &r, &region->rects[i]);
+            region->rects[i] = region->rects[--region->count];
+            i = 0;
+        }
+        else
+            i++;
+    }
+
+    if (region->count == DIRTY_MAX_RECTS)
+    {
+        // merge with whichever rect wastes the least area
+        int best = 0;
+        LONGLONG bestWaste = -1;
+
+        for (int i = 0; i < region->count; i++)
+        {
+            RECT u;
+            UnionRect(&u, &r, &region->rects[i]);
+
+            LONGLONG waste = Area(&u) - Area(&r) - Area(&region->rects[i]);
+
+            if (bestWaste < 0 || waste < bestWaste)
+            {
+                best = i;
+                bestWaste = waste;
+            }
+        }
+
+        UnionRect(&r, &r, &region->rects[best]);
+        region->rects[best] = region->rects[--region->count];
+
+        DirtyRegion_Add(region, &r);
+        return;
+    }
+
+    region->rects[region->count++] = r;
+
+    LONGLONG area = 0;
+
+    for (int i = 0; i < region->count; i++)
+        area += Area(&region->rects[i]);
+
+    if (area * 100 >= (LONGLONG)region->width * region->height * region->threshold)
+        DirtyRegion_SetFull(region);
+}
+
+void DirtyRegion_AddRegion(DirtyRegion *region, const DirtyRegion *other)
+{
+    if (other->full)
+    {
+        DirtyRegion_SetFull(region);
+        return;
+    }
+
+    for (int i = 0; i < other->count && !region->full; i++)
+        DirtyRegion_Add(region, &other->rects[i]);
+}
+
+bool DirtyRegion_Intersects(const DirtyRegion *region, const RECT *rc)
+{
+    if (region->full)
+        return true;
+
+    for (int i = 0; i < region->count; i++)
+    {
+        if (Overlaps(&region->rects[i], rc))
+            return true;
+    }
+
+    return false;
+}
+
+bool TileDiff_Init(TileDiff *diff, int width, int height)
+{
+    diff->width = width;
+    diff->height = height;
+    diff->columns = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    diff->rows = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    diff->hashes = calloc(diff->columns * diff->rows, sizeof(uint64_t));
+
+    return diff->hashes != NULL;
+}
+
+void TileDiff_Free(TileDiff *diff)
+{
+    free(diff->hashes);
+    diff->hashes = NULL;
+}
+
+/* narrows region down to the tiles inside area whose content really changed, returns how many did */
+int TileDiff_Update(TileDiff *diff, DirtyRegion *region, const void *surface, int pitch, const RECT *area)
+{
+    DirtyRegion damage = *region;
+    RECT bounds = { 0, 0, diff->width, diff->height };
+    RECT scan;
+    int changed = 0;
+
+    DirtyRegion_Reset(region);
+
+    if (!IntersectRect(&scan, &bounds, area))
+        return 0;
+
+    for (int ty = scan.top / TILE_HEIGHT; ty * TILE_HEIGHT < scan.bottom; ty++)
+    {
+        for (int tx = scan.left / TILE_WIDTH; tx * TILE_WIDTH < scan.right; tx++)
+        {
+            RECT tile = { tx * TILE_WIDTH, ty * TILE_HEIGHT, (tx + 1) * TILE_WIDTH, (ty + 1) * TILE_HEIGHT };
+            IntersectRect(&tile, &tile, &bounds);
+
+            if (!DirtyRegion_Intersects(&damage, &tile))
+                continue;
+
+            uint64_t hash = Blit_Hash16((const uint8_t *)surface + tile.top * pitch + tile.left * 2, pitch,
+                                        tile.right - tile.left, tile.bottom - tile.top);
+            uint64_t *last = &diff->hashes[ty * diff->columns + tx];
+
+            if (*last != hash)
+            {
+                *last = hash;
+                changed++;
+                DirtyRegion_Add(region, &tile);
+            }
+        }
+    }
+
+    return changed;
+}
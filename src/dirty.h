@@ -0,0 +1,42 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DIRTY_MAX_RECTS 16
+
+#define TILE_WIDTH 64
+#define TILE_HEIGHT 32
+
+// Damaged parts of a surface, rects never overlap. Once the area passes threshold percent of the surface
+// the whole surface counts as damaged
+typedef struct
+{
+    RECT rects[DIRTY_MAX_RECTS];
+    int count;
+    bool full;
+    int width;
+    int height;
+    int threshold;
+} DirtyRegion;
+
+void DirtyRegion_Init(DirtyRegion *region, int width, int height, int threshold);
+void DirtyRegion_Reset(DirtyRegion *region);
+void DirtyRegion_SetFull(DirtyRegion *region);
+void DirtyRegion_Add(DirtyRegion *region, const RECT *rc);
+void DirtyRegion_AddRegion(DirtyRegion *region, const DirtyRegion *other);
+bool DirtyRegion_Intersects(const DirtyRegion *region, const RECT *rc);
+
+// Hashes of every tile as it looked in the last frame
+typedef struct
+{
+    int width;
+    int height;
+    int columns;
+    int rows;
+    uint64_t *hashes;
+} TileDiff;
+
+bool TileDiff_Init(TileDiff *diff, int width, int height);
+void TileDiff_Free(TileDiff *diff);
+int TileDiff_Update(TileDiff *diff, DirtyRegion *region, const void *surface, int pitch, const RECT *area);
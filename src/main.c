@@ -45,6 +45,7 @@ int DrawFPS = 0;
 
 double TargetFPS = 60.0;
 double TargetFrameLen = 1000.0 / 60.0;
+bool SyncToGame = false;
 LONG Renderer = RENDERER_OPENGL;
 bool AutoRenderer = true;
 int SwapInterval = 0;
@@ -54,6 +55,16 @@ bool GlFinish = false;
 LONG MonitorEdgeTimer = 0;
 bool ThreadSafe = false;
 bool ConvertOnGPU = true;
+bool BilinearBlt = false;
+bool GdiBlt = false;
+int DirtyRectThreshold = 50;
+bool WriteWatch = false;
+bool TileDiffing = false;
+bool PersistentPBO = true;
+int MaxFramesInFlight = 2;
+bool ForceProbe = false;
+bool AsyncRenderer = false;
+bool SuspendHidden = true;
 
 HRESULT WINAPI DirectDrawCreate(GUID FAR* lpGUID, LPDIRECTDRAW FAR* lplpDD, IUnknown FAR* pUnkOuter)
 {
@@ -56,6 +56,7 @@ bool GameHandlesClose;
 int DrawFPS;
 double TargetFPS;
 double TargetFrameLen;
+bool SyncToGame;
 bool SingleProcAffinity;
 int SwapInterval;
 
@@ -71,6 +72,16 @@ bool GlFinish;
 LONG MonitorEdgeTimer;
 bool ThreadSafe;
 bool ConvertOnGPU;
+bool BilinearBlt;
+bool GdiBlt;
+int DirtyRectThreshold;
+bool WriteWatch;
+bool TileDiffing;
+bool PersistentPBO;
+int MaxFramesInFlight;
+bool ForceProbe;
+bool AsyncRenderer;
+bool SuspendHidden;
 
 #define debug_(format, ...) DebugPrint("xDBG " format "\n", ##__VA_ARGS__)
 
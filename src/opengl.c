@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include "opengl.h"
 #include "main.h"
+#include "blit.h"
 
 // Program
 PFNGLCREATEPROGRAMPROC glCreateProgram = NULL;
@@ -36,6 +37,9 @@ PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray = NULL;
 PFNGLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray = NULL;
 PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation = NULL;
 PFNGLGETACTIVEUNIFORMPROC glGetActiveUniform = NULL;
+PFNGLGETPROGRAMBINARYPROC glGetProgramBinary = NULL;
+PFNGLPROGRAMBINARYPROC glProgramBinary = NULL;
+PFNGLPROGRAMPARAMETERIPROC glProgramParameteri = NULL;
 
 // Shader
 PFNGLCREATESHADERPROC glCreateShader = NULL;
@@ -51,6 +55,9 @@ PFNGLBUFFERDATAPROC	glBufferData = NULL;
 PFNGLBUFFERSUBDATAPROC  glBufferSubData = NULL;
 PFNGLMAPBUFFERPROC      glMapBuffer = NULL;
 PFNGLUNMAPBUFFERPROC      glUnmapBuffer = NULL;
+PFNGLMAPBUFFERRANGEPROC glMapBufferRange = NULL;
+PFNGLCOPYBUFFERSUBDATAPROC glCopyBufferSubData = NULL;
+PFNGLBUFFERSTORAGEPROC glBufferStorage = NULL;
 PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer = NULL;
 PFNGLDELETEBUFFERSPROC glDeleteBuffers = NULL;
 PFNGLGENVERTEXARRAYSPROC glGenVertexArrays = NULL;
@@ -59,6 +66,11 @@ PFNGLDELETEVERTEXARRAYSPROC glDeleteVertexArrays = NULL;
 
 PFNGLACTIVETEXTUREPROC glActiveTexture = NULL;
 
+// Sync
+PFNGLFENCESYNCPROC glFenceSync = NULL;
+PFNGLCLIENTWAITSYNCPROC glClientWaitSync = NULL;
+PFNGLDELETESYNCPROC glDeleteSync = NULL;
+
 PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers = NULL;
 PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer = NULL;
 PFNGLBLITFRAMEBUFFERPROC glBlitFramebuffer = NULL;
@@ -102,6 +114,9 @@ void OpenGL_Init()
     glVertexAttrib4fv = (PFNGLVERTEXATTRIB4FVPROC)wglGetProcAddress("glVertexAttrib4fv");
     glEnableVertexAttribArray = (PFNGLENABLEVERTEXATTRIBARRAYPROC)wglGetProcAddress("glEnableVertexAttribArray");
     glBindAttribLocation = (PFNGLBINDATTRIBLOCATIONPROC)wglGetProcAddress("glBindAttribLocation");
+    glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)wglGetProcAddress("glGetProgramBinary");
+    glProgramBinary = (PFNGLPROGRAMBINARYPROC)wglGetProcAddress("glProgramBinary");
+    glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)wglGetProcAddress("glProgramParameteri");
 
     // Shader
     glCreateShader = (PFNGLCREATESHADERPROC)wglGetProcAddress("glCreateShader");
@@ -117,6 +132,9 @@ void OpenGL_Init()
     glBufferSubData = (PFNGLBUFFERSUBDATAPROC)wglGetProcAddress("glBufferSubData");
     glMapBuffer = (PFNGLMAPBUFFERPROC)wglGetProcAddress("glMapBuffer");
     glUnmapBuffer = (PFNGLUNMAPBUFFERPROC)wglGetProcAddress("glUnmapBuffer");
+    glMapBufferRange = (PFNGLMAPBUFFERRANGEPROC)wglGetProcAddress("glMapBufferRange");
+    glCopyBufferSubData = (PFNGLCOPYBUFFERSUBDATAPROC)wglGetProcAddress("glCopyBufferSubData");
+    glBufferStorage = (PFNGLBUFFERSTORAGEPROC)wglGetProcAddress("glBufferStorage");
     glVertexAttribPointer = (PFNGLVERTEXATTRIBPOINTERPROC)wglGetProcAddress("glVertexAttribPointer");
     glDeleteBuffers = (PFNGLDELETEBUFFERSPROC)wglGetProcAddress("glDeleteBuffers");
     glGenVertexArrays = (PFNGLGENVERTEXARRAYSPROC)wglGetProcAddress("glGenVertexArrays");
@@ -125,6 +143,11 @@ void OpenGL_Init()
 
     glActiveTexture = (PFNGLACTIVETEXTUREPROC)wglGetProcAddress("glActiveTexture");
 
+    // Sync
+    glFenceSync = (PFNGLFENCESYNCPROC)wglGetProcAddress("glFenceSync");
+    glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC)wglGetProcAddress("glClientWaitSync");
+    glDeleteSync = (PFNGLDELETESYNCPROC)wglGetProcAddress("glDeleteSync");
+
     glGenFramebuffers = (PFNGLGENFRAMEBUFFERSPROC)wglGetProcAddress("glGenFramebuffers");
     glBindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC)wglGetProcAddress("glBindFramebuffer");
     glBlitFramebuffer = (PFNGLBLITFRAMEBUFFERPROC)wglGetProcAddress("glBlitFramebuffer");
@@ -158,12 +181,155 @@ BOOL OpenGL_ExtExists(char *ext, HDC hdc)
     return FALSE;
 }
 
+static const char ProgramCacheDir[] = ".\\ddraw-shaders";
+
+static uint64_t HashString(uint64_t hash, const char *str)
+{
+    for (; str && *str; str++)
+        hash = (hash ^ (uint8_t)*str) * 1099511628211ull;
+
+    return hash;
+}
+
+// Drivers may hand out the entry points without supporting a single binary format
+static bool ProgramBinarySupported()
+{
+    if (!glGetProgramBinary || !glProgramBinary || !glProgramParameteri || !glGetProgramiv)
+        return false;
+
+    if (!OpenGL_ExtExists("GL_ARB_get_program_binary", wglGetCurrentDC()))
+        return false;
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+// A binary saved by another driver can carry a format this one doesn't know, glProgramBinary would raise an error
+static bool ProgramBinaryFormatKnown(GLenum format)
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &count);
+
+    GLint *formats = count > 0 ? malloc(count * sizeof(GLint)) : NULL;
+    bool known = false;
+
+    if (formats)
+    {
+        glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats);
+
+        for (int i = 0; i < count && !known; i++)
+            known = (GLenum)formats[i] == format;
+
+        free(formats);
+    }
+
+    return known;
+}
+
+// Binaries only load on the driver that produced them, so the driver strings are part of the name
+static bool ProgramCachePath(char *path, const GLchar *vertSource, const GLchar *fragSource)
+{
+    if (!ProgramBinarySupported())
+        return false;
+
+    uint64_t hash = 14695981039346656037ull;
+    hash = HashString(hash, (const char *)glGetString(GL_VENDOR));
+    hash = HashString(hash, (const char *)glGetString(GL_RENDERER));
+    hash = HashString(hash, (const char *)glGetString(GL_VERSION));
+    hash = HashString(hash, vertSource);
+    hash = HashString(hash, "\n--\n");
+    hash = HashString(hash, fragSource);
+
+    sprintf(path, "%s\\%08X%08X.bin", ProgramCacheDir, (unsigned int)(hash >> 32), (unsigned int)hash);
+    return true;
+}
+
+static GLuint LoadProgramBinary(const char *path)
+{
+    GLuint program = 0;
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return 0;
+
+    GLenum format;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file) - (long)sizeof(format);
+    fseek(file, 0, SEEK_SET);
+
+    void *binary = size > 0 ? malloc(size) : NULL;
+    if (binary && fread(&format, sizeof(format), 1, file) == 1 && fread(binary, size, 1, file) == 1 &&
+        ProgramBinaryFormatKnown(format))
+    {
+        program = glCreateProgram();
+        glProgramBinary(program, format, binary, size);
+
+        GLint isLinked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+        if (isLinked == GL_FALSE)
+        {
+            // A driver update invalidates binaries, the caller compiles and replaces it
+            dprintf("glProgramBinary rejected %s\n", path);
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+
+    free(binary);
+    fclose(file);
+    return program;
+}
+
+static void SaveProgramBinary(GLuint program, const char *path)
+{
+    GLint size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0)
+        return;
+
+    void *binary = malloc(size);
+    GLenum format;
+
+    // The written length tells whether it worked, glGetError would swallow errors the renderer checks for later
+    if (binary)
+    {
+        GLsizei length = 0;
+        glGetProgramBinary(program, size, &length, &format, binary);
+
+        if (length == size)
+        {
+            CreateDirectory(ProgramCacheDir, NULL);
+
+            FILE *file = fopen(path, "wb");
+            if (file)
+            {
+                fwrite(&format, sizeof(format), 1, file);
+                fwrite(binary, size, 1, file);
+                fclose(file);
+            }
+        }
+
+        free(binary);
+    }
+}
+
 GLuint OpenGL_BuildProgram(const GLchar *vertSource, const GLchar *fragSource)
 {
     if (!glCreateShader || !glShaderSource || !glCompileShader || !glCreateProgram ||
         !glAttachShader || !glLinkProgram || !glUseProgram || !glDetachShader)
         return 0;
 
+    char cachePath[MAX_PATH];
+    bool cacheable = ProgramCachePath(cachePath, vertSource, fragSource);
+
+    if (cacheable)
+    {
+        GLuint program = LoadProgramBinary(cachePath);
+        if (program)
+            return program;
+    }
+
     GLuint vertShader = glCreateShader(GL_VERTEX_SHADER);
     GLuint fragShader = glCreateShader(GL_FRAGMENT_SHADER);
 
@@ -210,6 +376,9 @@ GLuint OpenGL_BuildProgram(const GLchar *vertSource, const GLchar *fragSource)
         glAttachShader(program, vertShader);
         glAttachShader(program, fragShader);
 
+        if (cacheable)
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
         glLinkProgram(program);
 
         glDetachShader(program, vertShader);
@@ -229,6 +398,9 @@ GLuint OpenGL_BuildProgram(const GLchar *vertSource, const GLchar *fragSource)
                 return 0;
             }
         }
+
+        if (cacheable)
+            SaveProgramBinary(program, cachePath);
     }
 
     return program;
@@ -357,7 +529,12 @@ BOOL ShaderTest(GLuint convProgram, int width, int height, GLint internalFormat,
     BOOL setupFailed = FALSE;
 
     uint16_t inTestData[] = { (16 << U565_RED) | (32 << U565_GREEN) | (16 << U565_BLUE) };
-    uint32_t outTestData[] = { (128 << RGBA_RED) | (128 << RGBA_GREEN) | (128 << RGBA_BLUE) };
+    uint32_t outTestData[sizeof(inTestData)/sizeof(inTestData[0])];
+
+    // the shader has to match the CPU conversion, except that it leaves alpha at 0
+    Blit_Convert565To8888(outTestData, sizeof(outTestData), inTestData, sizeof(inTestData), sizeof(inTestData)/sizeof(inTestData[0]), 1);
+    for (int i = 0; i < sizeof(outTestData)/sizeof(outTestData[0]); ++i)
+        outTestData[i] &= ~(0xFFu << RGBA_ALPHA);
 
     uint16_t *inBuffer = (uint16_t*)calloc(1, 2 * width * height);
     uint32_t *outBuffer = (uint32_t*)calloc(1, 4 * width * height);
@@ -478,3 +655,60 @@ finish:
     dprintf("<-- ShaderTest(%d, %d, %d, %d, %d, %d) %d\n", convProgram, width, height, internalFormat, format, type, result);
     return result;
 }
+
+
+static const char ProbeCachePath[] = ".\\ddraw-probe.ini";
+
+// The section is a hash of the driver strings and size, the full key is stored to catch collisions
+static void ProbeCacheKey(char *section, char *key, int keySize, int width, int height)
+{
+    const char *vendor = (const char *)glGetString(GL_VENDOR);
+    const char *renderer = (const char *)glGetString(GL_RENDERER);
+    const char *version = (const char *)glGetString(GL_VERSION);
+
+    _snprintf(key, keySize - 1, "%s|%s|%s|%dx%d", vendor ? vendor : "", renderer ? renderer : "",
+        version ? version : "", width, height);
+    key[keySize - 1] = 0;
+
+    uint32_t hash = 2166136261u;
+    for (const char *c = key; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+
+    sprintf(section, "%08X", hash);
+}
+
+void OpenGL_LoadProbeCache(OpenGLProbeCache *cache, int width, int height)
+{
+    char section[16], key[512], stored[512];
+
+    cache->gpuConversion = -1;
+    cache->textureFormat = -1;
+
+    if (ForceProbe)
+        return;
+
+    ProbeCacheKey(section, key, sizeof(key), width, height);
+    GetPrivateProfileString(section, "Key", "", stored, sizeof(stored), ProbeCachePath);
+
+    if (strcmp(key, stored) != 0)
+        return;
+
+    cache->gpuConversion = GetPrivateProfileInt(section, "GpuConversion", -1, ProbeCachePath);
+    cache->textureFormat = GetPrivateProfileInt(section, "TextureFormat", -1, ProbeCachePath);
+
+    dprintf("Renderer: Using cached probe results for %s\n", key);
+}
+
+void OpenGL_SaveProbeCache(const OpenGLProbeCache *cache, int width, int height)
+{
+    char section[16], key[512], value[16];
+
+    ProbeCacheKey(section, key, sizeof(key), width, height);
+    WritePrivateProfileString(section, "Key", key, ProbeCachePath);
+
+    sprintf(value, "%d", cache->gpuConversion);
+    WritePrivateProfileString(section, "GpuConversion", value, ProbeCachePath);
+
+    sprintf(value, "%d", cache->textureFormat);
+    WritePrivateProfileString(section, "TextureFormat", value, ProbeCachePath);
+}
@@ -3,13 +3,21 @@
 #include "IDirectDrawSurface.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "counter.h"
+#include "scheduler.h"
 
 #include "opengl.h"
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include "glext.h"
 
+#define MAX_FRAMES_IN_FLIGHT 8
+#define SYNC_MISSES 3
+// ms a swap has to block for before its return counts as vblank
+#define SWAP_BLOCKED 0.5
+#define SUSPEND_RECHECK 250
+
 const GLchar *PassthroughVertShaderSrc =
     "#version 130\n"
     "in vec4 VertexCoord;\n"
@@ -70,10 +78,10 @@ BOOL CALLBACK EnumChildProc(HWND hWnd, LPARAM lParam)
 
     LONG renderer = InterlockedExchangeAdd(&Renderer, 0);
 
-    if (this->usingPBO && renderer == RENDERER_OPENGL)
+    if (this->surface != this->systemSurface && renderer == RENDERER_OPENGL)
     {
         //the GDI struggle is real
-        // Copy the scanlines of menu windows from pboSurface to the gdi surface
+        // Copy the scanlines of menu windows from pboSurface or the watched surface to the gdi surface
         SelectObject(this->hDC, this->bitmap);
         memcpy((uint8_t*)this->systemSurface + (pos.top * this->lPitch),
                (uint8_t*)this->surface + (pos.top * this->lPitch),
@@ -83,7 +91,7 @@ BOOL CALLBACK EnumChildProc(HWND hWnd, LPARAM lParam)
 
     BitBlt(hDC, 0, 0, size.right, size.bottom, this->hDC, pos.left, pos.top, SRCCOPY);
 
-    if (this->usingPBO && renderer == RENDERER_OPENGL)
+    if (this->surface != this->systemSurface && renderer == RENDERER_OPENGL)
     {
         SelectObject(this->hDC, this->defaultBM);
     }
@@ -94,6 +102,170 @@ BOOL CALLBACK EnumChildProc(HWND hWnd, LPARAM lParam)
 }
 
 
+// Turns the pages written since the last frame into full width scanline bands
+static void AddWrittenRows(IDirectDrawSurfaceImpl *this)
+{
+    SIZE_T size = this->height * this->lPitch;
+    ULONG_PTR count = this->watchPageCount;
+    ULONG granularity;
+
+    if (GetWriteWatch(WRITE_WATCH_FLAG_RESET, this->watchSurface, size, this->watchPages, &count, &granularity) != 0)
+    {
+        DirtyRegion_Add(&this->dirty, NULL);
+        return;
+    }
+
+    for (ULONG_PTR i = 0; i < count;)
+    {
+        SIZE_T start = (uint8_t *)this->watchPages[i] - (uint8_t *)this->watchSurface;
+        SIZE_T end = start + granularity;
+
+        while (++i < count && (SIZE_T)((uint8_t *)this->watchPages[i] - (uint8_t *)this->watchSurface) == end)
+            end += granularity;
+
+        RECT rc = { 0, start / this->lPitch, this->width, (end + this->lPitch - 1) / this->lPitch };
+        DirtyRegion_Add(&this->dirty, &rc);
+    }
+}
+
+
+// Collects what changed since the last frame, with tile hashing damage that left the pixels alone or lies outside
+// the view is dropped. Written gets everything the game touched, before any of that filtering
+static int TakeFrameDamage(IDirectDrawSurfaceImpl *this, DirtyRegion *written, DirtyRegion *frame, TileDiff *tiles,
+    const RECT *view)
+{
+    if (this->watchSurface && this->surface == this->watchSurface)
+        AddWrittenRows(this);
+
+    *frame = this->dirty;
+    DirtyRegion_Reset(&this->dirty);
+
+    if (written)
+        *written = *frame;
+
+    if (!tiles->hashes || !this->surface)
+        return -1;
+
+    return TileDiff_Update(tiles, frame, this->surface, this->lPitch, view);
+}
+
+
+// Waits for the upload that last read from a buffer or slice of the ring
+static bool WaitPBOFence(IDirectDrawSurfaceImpl *this, int index)
+{
+    GLsync fence = this->pboFences[index];
+    if (!fence)
+        return true;
+
+    GLenum result;
+    do
+    {
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+    } while (result == GL_TIMEOUT_EXPIRED);
+
+    glDeleteSync(fence);
+    this->pboFences[index] = NULL;
+
+    return result != GL_WAIT_FAILED;
+}
+
+
+// Maps a buffer of the ring, with fences only the upload that last read from it has to be done. Persistent
+// slices stay mapped and only wait for that upload
+static void *MapPBO(IDirectDrawSurfaceImpl *this, int index)
+{
+    if (this->usingPersistent)
+    {
+        WaitPBOFence(this, index);
+        return this->persistentSurface + (intptr_t)index * this->height * this->lPitch;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[index]);
+
+    if (!this->pboFences || !WaitPBOFence(this, index))
+        return glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_READ_WRITE);
+
+    return glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, this->height * this->lPitch,
+        GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+
+// Brings a buffer of the ring up to date by copying the scanlines it missed from the current one
+static void CopyStaleRows(IDirectDrawSurfaceImpl *this, void *dst, const void *src, DirtyRegion *stale)
+{
+    if (stale->full)
+    {
+        memcpy(dst, src, this->height * this->lPitch);
+    }
+    else
+    {
+        for (int i = 0; i < stale->count; i++)
+        {
+            RECT *rc = &stale->rects[i];
+            memcpy((uint8_t *)dst + rc->top * this->lPitch, (const uint8_t *)src + rc->top * this->lPitch,
+                (rc->bottom - rc->top) * this->lPitch);
+        }
+    }
+
+    DirtyRegion_Reset(stale);
+}
+
+
+// One buffer with a slice per frame, mapped for the lifetime of the renderer. The game draws straight into a slice
+// like it does into a mapped buffer of the ring, and reads from it too so it is kept in client memory
+static bool CreatePersistentPBO(IDirectDrawSurfaceImpl *this)
+{
+    if (!PersistentPBO || !glBufferStorage || !this->pboFences || !OpenGL_ExtExists("GL_ARB_buffer_storage", this->dd->hDC))
+        return false;
+
+    GLsizeiptr size = (GLsizeiptr)this->height * this->lPitch * this->pboCount;
+    GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[0]);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags | GL_CLIENT_STORAGE_BIT);
+
+    GLenum gle = glGetError();
+    if (gle == GL_NO_ERROR)
+        this->persistentSurface = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (gle != GL_NO_ERROR || !this->persistentSurface)
+    {
+        dprintf("glBufferStorage, %x\n", gle != GL_NO_ERROR ? gle : glGetError());
+
+        // Storage is immutable once allocated, the regular ring needs a fresh buffer
+        glDeleteBuffers(1, &this->pbo[0]);
+        glGenBuffers(1, &this->pbo[0]);
+        glGetError();
+
+        this->persistentSurface = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Uploads the damage from the bound unpack buffer, offset is where the frame starts in it
+static void UploadRegion(IDirectDrawSurfaceImpl *this, const DirtyRegion *upload, intptr_t offset, GLenum format, GLenum type)
+{
+    RECT all = { 0, 0, this->width, this->height };
+    int count = upload->full ? 1 : upload->count;
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, this->width);
+
+    for (int i = 0; i < count; i++)
+    {
+        const RECT *rc = upload->full ? &all : &upload->rects[i];
+        glTexSubImage2D(this->textureTarget, 0, rc->left, rc->top, rc->right - rc->left, rc->bottom - rc->top,
+            format, type, (void *)(offset + rc->top * this->lPitch + rc->left * this->lXPitch));
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+
 BOOL ShouldStretch(IDirectDrawSurfaceImpl *this)
 {
     if (!this->dd->render.stretched)
@@ -108,11 +280,95 @@ BOOL ShouldStretch(IDirectDrawSurfaceImpl *this)
 }
 
 
+// Fences the frame just swapped and waits for the one from limit frames ago, returns how many older frames were still queued
+static int LimitFramesInFlight(GLsync *fences, int *index, int limit)
+{
+    int depth = 0;
+
+    for (int i = 0; i <= MAX_FRAMES_IN_FLIGHT; i++)
+    {
+        if (!fences[i])
+            continue;
+
+        if (glClientWaitSync(fences[i], 0, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            depth++;
+        }
+        else
+        {
+            glDeleteSync(fences[i]);
+            fences[i] = NULL;
+        }
+    }
+
+    fences[*index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    GLsync *oldest = &fences[(*index + MAX_FRAMES_IN_FLIGHT + 1 - limit) % (MAX_FRAMES_IN_FLIGHT + 1)];
+    if (*oldest)
+    {
+        while (glClientWaitSync(*oldest, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED);
+
+        glDeleteSync(*oldest);
+        *oldest = NULL;
+    }
+
+    *index = (*index + 1) % (MAX_FRAMES_IN_FLIGHT + 1);
+    return depth;
+}
+
+
+// Minimized, or fully covered so nothing of the client area is left to draw to
+static bool WindowHidden(IDirectDrawSurfaceImpl *this)
+{
+    RECT clip;
+    return IsIconic(this->dd->hWnd) || GetClipBox(this->dd->hDC, &clip) == NULLREGION;
+}
+
+// Shows the DIB with GDI while the render thread is still setting up OpenGL
+static DWORD WINAPI PresentWhileStarting(IDirectDrawSurfaceImpl *this)
+{
+    GdiSetBatchLimit(1);
+
+    while (WaitForSingleObject(this->pSurfaceReady, (DWORD)TargetFrameLen) == WAIT_TIMEOUT)
+    {
+        EnterCriticalSection(&this->lock);
+
+        if (ShouldStretch(this))
+        {
+            StretchBlt(this->dd->hDC,
+                this->dd->render.viewport.x, this->dd->render.viewport.y,
+                this->dd->render.viewport.width, this->dd->render.viewport.height,
+                this->hDC, this->dd->winRect.left, this->dd->winRect.top, this->dd->width, this->dd->height, SRCCOPY);
+        }
+        else
+        {
+            BitBlt(this->dd->hDC, 0, 0, this->width, this->height, this->hDC,
+                this->dd->winRect.left, this->dd->winRect.top, SRCCOPY);
+        }
+
+        LeaveCriticalSection(&this->lock);
+    }
+
+    return 0;
+}
+
+
+static double RenderClock(void *context)
+{
+    return CounterGet((QPCounter *)context);
+}
+
+
 DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
 {
     GdiSetBatchLimit(1);
 
+    HANDLE presenter = NULL;
+    if (AsyncRenderer && InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL)
+        presenter = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)PresentWhileStarting, (LPVOID)this, 0, NULL);
+
     // Begin OpenGL Setup
+    void *nextSurface = this->systemSurface;
     bool failToGDI = false;
     BOOL gotOpenglV3;
     GLuint convProgram = 0;
@@ -136,8 +392,15 @@ DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
 
         this->pboCount = InterlockedExchangeAdd(&PrimarySurfacePBO, 0);
         this->pbo = calloc(this->pboCount, sizeof(GLuint));
+        this->pboStale = calloc(this->pboCount, sizeof(DirtyRegion));
         this->pboIndex = 0;
 
+        for (int i = 0; i < this->pboCount; ++i)
+            DirtyRegion_Init(&this->pboStale[i], this->width, this->height, DirtyRectThreshold);
+
+        if (glFenceSync && glClientWaitSync && glDeleteSync && glMapBufferRange)
+            this->pboFences = calloc(this->pboCount, sizeof(GLsync));
+
         this->dd->glInfo.initialized = true;
 
         if (wglSwapIntervalEXT)
@@ -168,16 +431,52 @@ DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
         int v = this->width;
         // A trick: v will be set to a power of 2
         v--; v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8; v |= v >> 16; v++;
-        this->textureWidth = v;
+        int potWidth = v;
 
         v = this->height;
         v--; v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8; v |= v >> 16; v++;
-        this->textureHeight = v;
+        int potHeight = v;
+
+        this->textureTarget = GL_TEXTURE_2D;
+        this->textureWidth = this->width;
+        this->textureHeight = this->height;
+
+        if ((glversion && atoi(glversion) >= 2) || OpenGL_ExtExists("GL_ARB_texture_non_power_of_two", this->dd->hDC))
+        {
+            ScaleW = ScaleH = 1.0f;
+        }
+        else if (OpenGL_ExtExists("GL_ARB_texture_rectangle", this->dd->hDC) ||
+            OpenGL_ExtExists("GL_EXT_texture_rectangle", this->dd->hDC) ||
+            OpenGL_ExtExists("GL_NV_texture_rectangle", this->dd->hDC))
+        {
+            // Rectangle textures are addressed in texels and the shaders only know sampler2D
+            this->textureTarget = GL_TEXTURE_RECTANGLE;
+            ScaleW = this->width;
+            ScaleH = this->height;
 
-        ScaleW = (float)this->width / this->textureWidth;
-        ScaleH = (float)this->height / this->textureHeight;
+            if (convProgram)
+            {
+                glDeleteProgram(convProgram);
+                convProgram = 0;
+            }
+        }
+        else
+        {
+            this->textureWidth = potWidth;
+            this->textureHeight = potHeight;
+            ScaleW = (float)this->width / this->textureWidth;
+            ScaleH = (float)this->height / this->textureHeight;
+        }
         dprintf("Renderer: Texture dimensions (%d, %d)\n", this->textureWidth, this->textureHeight);
 
+        // The format tests run on 2D textures, which have to be a power of two when rectangles are in use
+        int testWidth = this->textureTarget == GL_TEXTURE_2D ? this->textureWidth : potWidth;
+        int testHeight = this->textureTarget == GL_TEXTURE_2D ? this->textureHeight : potHeight;
+
+        OpenGLProbeCache probe;
+        OpenGL_LoadProbeCache(&probe, testWidth, testHeight);
+        OpenGLProbeCache cached = probe;
+
         int i;
 setup_shaders:
         if (convProgram)
@@ -246,7 +545,7 @@ setup_shaders:
 
         for (i = 0; i < 2; i++)
         {
-            glBindTexture(GL_TEXTURE_2D, this->textures[i]);
+            glBindTexture(this->textureTarget, this->textures[i]);
 
             failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
             if (gle != GL_NO_ERROR)
@@ -254,9 +553,15 @@ setup_shaders:
 
             if (convProgram && ConvertOnGPU)
             {
-                if (!TextureUploadTest(this->textureWidth, this->textureHeight, texInternal = GL_RG8, texFormat = GL_RG, texType = GL_UNSIGNED_BYTE)
-                    ||
-                    !ShaderTest(convProgram, this->textureWidth, this->textureHeight, texInternal, texFormat, texType))
+                texInternal = GL_RG8, texFormat = GL_RG, texType = GL_UNSIGNED_BYTE;
+
+                if (probe.gpuConversion < 0)
+                {
+                    probe.gpuConversion = TextureUploadTest(testWidth, testHeight, texInternal, texFormat, texType) &&
+                        ShaderTest(convProgram, testWidth, testHeight, texInternal, texFormat, texType);
+                }
+
+                if (!probe.gpuConversion)
                 {
                     convProgram = OpenGL_BuildProgram(PassthroughVertShaderSrc, PassthroughFragShaderSrc);
                     //Prevent infinite loop by setting ConvertOnGPU
@@ -274,11 +579,21 @@ setup_shaders:
             }
             else
             {
-                if (!TextureUploadTest(this->textureWidth, this->textureHeight,
-                                       texInternal = GL_RGB565, texFormat = GL_RGB, texType = GL_UNSIGNED_SHORT_5_6_5)
-                    &&
-                    !TextureUploadTest(this->textureWidth, this->textureHeight,
-                                       texInternal = GL_RGB5, texFormat = GL_RGB, texType = GL_UNSIGNED_SHORT_5_6_5))
+                texFormat = GL_RGB, texType = GL_UNSIGNED_SHORT_5_6_5;
+
+                if (probe.textureFormat < 0)
+                {
+                    if (TextureUploadTest(testWidth, testHeight, GL_RGB565, texFormat, texType))
+                        probe.textureFormat = GL_RGB565;
+                    else if (TextureUploadTest(testWidth, testHeight, GL_RGB5, texFormat, texType))
+                        probe.textureFormat = GL_RGB5;
+                    else
+                        probe.textureFormat = 0;
+                }
+
+                texInternal = probe.textureFormat;
+
+                if (!texInternal)
                 {
 
                     failToGDI = true;
@@ -286,39 +601,39 @@ setup_shaders:
                 }
             }
 
-            glBindTexture(GL_TEXTURE_2D, this->textures[i]);
+            glBindTexture(this->textureTarget, this->textures[i]);
 
             failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
             if (gle != GL_NO_ERROR)
                 dprintf("glBindTexture, %x\n", gle);
 
-            glTexImage2D(GL_TEXTURE_2D, 0, texInternal, this->textureWidth, this->textureHeight, 0, texFormat, texType, NULL);
+            glTexImage2D(this->textureTarget, 0, texInternal, this->textureWidth, this->textureHeight, 0, texFormat, texType, NULL);
 
             failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
             if (gle != GL_NO_ERROR)
                 dprintf("glTexImage2D i = %d, %x\n", i, gle);
 
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(this->textureTarget, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
             failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
             if (gle != GL_NO_ERROR)
                 dprintf("glTexParameteri MIN, %x\n", gle);
 
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(this->textureTarget, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
             failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
             if (gle != GL_NO_ERROR)
                 dprintf("glTexParameteri MAG, %x\n", gle);
 
 
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            glTexParameteri(this->textureTarget, GL_TEXTURE_MAX_LEVEL, 0);
 
             if (gle != GL_NO_ERROR)
                 dprintf("glTexParameteri MAX, %x\n", gle);
         }
 
         if (!convProgram)
-            glEnable(GL_TEXTURE_2D);
+            glEnable(this->textureTarget);
 
         failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
         if (gle != GL_NO_ERROR)
@@ -337,7 +652,15 @@ setup_shaders:
             }
         }
 
-        if (glBindBuffer && gle == GL_NO_ERROR  && this->pboCount)
+        if (glBindBuffer && gle == GL_NO_ERROR && this->pboCount && CreatePersistentPBO(this))
+        {
+            this->usingPersistent = true;
+            this->usingPBO = true;
+            this->pboSurface = this->persistentSurface;
+            nextSurface = this->pboSurface;
+            dprintf("Renderer: Uploading through %d persistently mapped slices\n", this->pboCount);
+        }
+        else if (glBindBuffer && gle == GL_NO_ERROR  && this->pboCount)
         {
 
             for (int i = 0; i < this->pboCount; ++i)
@@ -363,7 +686,7 @@ setup_shaders:
 
             if (glMapBuffer)
             {
-                this->pboSurface = (void*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_READ_WRITE);
+                this->pboSurface = MapPBO(this, 0);
 
                 gle = glGetError();
                 if (gle != GL_NO_ERROR)
@@ -375,9 +698,7 @@ setup_shaders:
                 if (InterlockedExchangeAdd(&PrimarySurfacePBO, 0) && InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL)
                 {
                     this->usingPBO = true;
-
-                    this->surface = this->pboSurface;
-                    SelectObject(this->hDC, this->defaultBM);
+                    nextSurface = this->pboSurface;
                 }
 
             }
@@ -392,7 +713,39 @@ setup_shaders:
             this->dd->glInfo.pboSupported = false;
             this->usingPBO = false;
             this->pboSurface = NULL;
-            this->surface = this->systemSurface;
+            nextSurface = this->systemSurface;
+        }
+
+        if (memcmp(&probe, &cached, sizeof(probe)) != 0)
+            OpenGL_SaveProbeCache(&probe, testWidth, testHeight);
+    }
+
+    if (WriteWatch && !this->usingPBO && !failToGDI)
+    {
+        // Surface memory the kernel tracks writes to, the DIB only gets used while GDI renders
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+
+        SIZE_T size = this->height * this->lPitch;
+        this->watchPageCount = (size + si.dwPageSize - 1) / si.dwPageSize;
+        this->watchPages = malloc(this->watchPageCount * sizeof(PVOID));
+        this->watchSurface = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_WRITE_WATCH, PAGE_READWRITE);
+
+        if (this->watchSurface && this->watchPages)
+        {
+            nextSurface = this->watchSurface;
+            dprintf("Renderer: Tracking surface writes with MEM_WRITE_WATCH\n");
+        }
+        else
+        {
+            dprintf("VirtualAlloc(MEM_WRITE_WATCH) failed, %d\n", (int)GetLastError());
+
+            if (this->watchSurface)
+                VirtualFree(this->watchSurface, 0, MEM_RELEASE);
+
+            free(this->watchPages);
+            this->watchSurface = NULL;
+            this->watchPages = NULL;
         }
     }
 
@@ -400,18 +753,36 @@ setup_shaders:
     {
         InterlockedExchange(&Renderer, RENDERER_GDI);
 
-        this->surface = this->systemSurface;
+        nextSurface = this->systemSurface;
         this->dd->glInfo.glSupported = false;
-        if (this->usingPBO)
-        {
-            this->usingPBO = false;
-            this->pboSurface = NULL;
-            SelectObject(this->hDC, this->bitmap);
-        }
+        this->usingPBO = false;
+        this->pboSurface = NULL;
         wglMakeCurrent(NULL, NULL);
     }
 
     SetEvent(this->pSurfaceReady);
+
+    if (presenter)
+    {
+        WaitForSingleObject(presenter, INFINITE);
+        CloseHandle(presenter);
+    }
+
+    // The game may have been drawing into the DIB all along, it moves over in one step. Lock holds the critical
+    // section until Unlock, so this waits for any lock the game has open
+    if (nextSurface != this->systemSurface)
+    {
+        EnterCriticalSection(&this->lock);
+
+        memcpy(nextSurface, this->systemSurface, this->height * this->lPitch);
+        if (nextSurface == this->watchSurface)
+            ResetWriteWatch(this->watchSurface, this->height * this->lPitch);
+
+        this->surface = nextSurface;
+        SelectObject(this->hDC, this->defaultBM);
+
+        LeaveCriticalSection(&this->lock);
+    }
     // End OpenGL Setup
 
 
@@ -425,30 +796,32 @@ setup_shaders:
         SendMessage(this->dd->hWnd, WM_ACTIVATE, WA_ACTIVE, 0);
     }
 
-    if (InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL && SwapInterval > 0)
+    double refreshRate = 0.0;
+    if ((InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL && SwapInterval > 0) || SyncToGame)
     {
         DEVMODE lpDevMode;
         memset(&lpDevMode, 0, sizeof(DEVMODE));
         lpDevMode.dmSize = sizeof(DEVMODE);
         lpDevMode.dmDriverExtra = 0;
 
-        if (EnumDisplaySettings(NULL, ENUM_CURRENT_SETTINGS, &lpDevMode))
+        // The monitor the window is on, not necessarily the primary one
+        MONITORINFOEX monitorInfo;
+        memset(&monitorInfo, 0, sizeof(MONITORINFOEX));
+        monitorInfo.cbSize = sizeof(MONITORINFOEX);
+
+        HMONITOR monitor = MonitorFromWindow(this->dd->hWnd, MONITOR_DEFAULTTOPRIMARY);
+        LPCSTR device = GetMonitorInfo(monitor, (LPMONITORINFO)&monitorInfo) ? monitorInfo.szDevice : NULL;
+
+        if (EnumDisplaySettings(device, ENUM_CURRENT_SETTINGS, &lpDevMode) && lpDevMode.dmDisplayFrequency > 1)
         {
             TargetFPS = (double)lpDevMode.dmDisplayFrequency;
+            refreshRate = TargetFPS;
         }
     }
 
     LONG renderer = InterlockedExchangeAdd(&Renderer, 0);
     QPCounter renderCounter;
-    double tick_time = 0.0;
     TargetFrameLen = 1000.0 / TargetFPS;
-    double startTargetFPS = TargetFPS;
-
-    double avg_len = TargetFrameLen;
-    double recent_frames[FRAME_SAMPLES] = { -1.0 };
-    double render_time = 0.0;
-    double best_time = 0.0;
-    int rIndex = 0;
 
     RECT textRect = (RECT){0,0,0,0};
     char fpsOglString[256] = "OpenGL\nFPS: NA\nTGT: NA\n";
@@ -457,17 +830,31 @@ setup_shaders:
     double warningDuration = 0.0;
     QPCounter warningCounter;
     bool hideWarning = true;
-    double avg_fps = 0;
 
-    // Vsync calculator variables
-    double floor = 0;
-    double ceiling = TargetFrameLen + 1;
-    bool descending = true;
-    double sleep = TargetFrameLen;
-    double previous_best = TargetFrameLen * 2;
-    double best_sleep = 0;
+    // damage not yet uploaded to each texture, both start out stale
+    DirtyRegion uploads[2];
+    DirtyRegion_Init(&uploads[0], this->width, this->height, DirtyRectThreshold);
+    DirtyRegion_Init(&uploads[1], this->width, this->height, DirtyRectThreshold);
+    RECT uploadedView = { 0, 0, 0, 0 };
+    bool presentAll = true;
+
+    TileDiff tiles = { 0 };
+    int changedTiles = -1;
+
+    // GlFinish drains the whole queue every frame, otherwise the GPU may run this many frames behind
+    GLsync frameFences[MAX_FRAMES_IN_FLIGHT + 1] = { 0 };
+    int frameFence = 0;
+    int queueDepth = -1;
+    int framesInFlight = GlFinish ? 0 : max(0, min(MaxFramesInFlight, MAX_FRAMES_IN_FLIGHT));
+
+    if (TileDiffing && !TileDiff_Init(&tiles, this->width, this->height))
+        dprintf("Renderer: Not enough memory for tile hashes\n");
 
     CounterStart(&renderCounter);
+
+    Scheduler sched;
+    Scheduler_Init(&sched, RenderClock, &renderCounter, TargetFPS);
+    Scheduler_SetRefreshRate(&sched, refreshRate);
     CounterStart(&warningCounter);
 
     if (failToGDI)
@@ -478,6 +865,13 @@ setup_shaders:
         TargetFrameLen = 1000.0 / TargetFPS;
     }
 
+    // Until the game signals a finished frame there is nothing to wait for, it goes back to that after it stops
+    int missedSignals = SYNC_MISSES;
+
+    FrameTimer frameTimer;
+    FrameTimer_Init(&frameTimer);
+    double waitCPU = 0.0;
+
     while (this->thread)
     {
         static int texIndex = 0;
@@ -493,18 +887,29 @@ setup_shaders:
             switch (renderer)
             {
             case RENDERER_GDI:
+            {
                 EnterCriticalSection(&this->lock);
-                if (DrawFPS)
+                if (DrawFPS || !hideWarning)
                 {
                     textRect.left = this->dd->winRect.left;
                     textRect.top = this->dd->winRect.top;
-                    DrawText(this->hDC, fpsGDIString, -1, &textRect, DT_NOCLIP);
+
+                    int textHeight = DrawText(this->hDC, DrawFPS ? fpsGDIString : warningText, -1, &textRect, DT_NOCLIP);
+
+                    RECT textRows = { 0, textRect.top, this->width, textRect.top + textHeight };
+                    DirtyRegion_Add(&this->dirty, &textRows);
                 }
-                else if (!hideWarning)
+
+                RECT view = { this->dd->winRect.left, this->dd->winRect.top,
+                    this->dd->winRect.left + this->dd->width, this->dd->winRect.top + this->dd->height };
+
+                DirtyRegion frame;
+                changedTiles = TakeFrameDamage(this, NULL, &frame, &tiles, &view);
+
+                if (InterlockedExchange(&this->dd->render.repaint, FALSE) || !EqualRect(&view, &uploadedView))
                 {
-                    textRect.left = this->dd->winRect.left;
-                    textRect.top = this->dd->winRect.top;
-                    DrawText(this->hDC, warningText, -1, &textRect, DT_NOCLIP);
+                    uploadedView = view;
+                    presentAll = true;
                 }
 
                 if (ShouldStretch(this))
@@ -522,17 +927,42 @@ setup_shaders:
                             this->dd->render.viewport.width, this->dd->render.viewport.height,
                             this->hDC, this->dd->winRect.left, this->dd->winRect.top, this->dd->width, this->dd->height, SRCCOPY);
                     }
+
+                    presentAll = true;
                 }
                 else
                 {
                     if (this->dd->render.stretched)
                         this->dd->render.invalidate = TRUE;
 
-                    BitBlt(this->dd->hDC, 0, 0, this->width, this->height, this->hDC,
-                        this->dd->winRect.left, this->dd->winRect.top, SRCCOPY);
+                    if (presentAll || frame.full)
+                    {
+                        BitBlt(this->dd->hDC, 0, 0, this->width, this->height, this->hDC,
+                            this->dd->winRect.left, this->dd->winRect.top, SRCCOPY);
+
+                        presentAll = false;
+                    }
+                    else
+                    {
+                        for (int i = 0; i < frame.count; i++)
+                        {
+                            RECT *rc = &frame.rects[i];
+
+                            BitBlt(this->dd->hDC, rc->left - this->dd->winRect.left, rc->top - this->dd->winRect.top,
+                                rc->right - rc->left, rc->bottom - rc->top, this->hDC, rc->left, rc->top, SRCCOPY);
+                        }
+                    }
                 }
+
+                // GDI presents everything, textures are stale by the time OpenGL takes over again
+                DirtyRegion_SetFull(&uploads[0]);
+                DirtyRegion_SetFull(&uploads[1]);
+
+                for (int i = 0; this->pboStale && i < this->pboCount; i++)
+                    DirtyRegion_SetFull(&this->pboStale[i]);
                 LeaveCriticalSection(&this->lock);
                 break;
+            }
 
             case RENDERER_OPENGL:
 
@@ -542,7 +972,7 @@ setup_shaders:
                     textRect.left = this->dd->winRect.left;
                     textRect.top = this->dd->winRect.top;
 
-                    if (this->usingPBO && this->surface)
+                    if (this->surface && this->surface != this->systemSurface)
                     {
                         // Copy the scanlines that will be behind the FPS counter to the GDI surface
                         memcpy((uint8_t*)this->systemSurface + (textRect.top * this->lPitch),
@@ -553,7 +983,10 @@ setup_shaders:
 
                     textRect.bottom = DrawText(this->hDC, fpsOglString, -1, &textRect, DT_NOCLIP);
 
-                    if (this->usingPBO && this->surface)
+                    RECT fpsRect = { 0, textRect.top, this->width, textRect.top + textRect.bottom };
+                    DirtyRegion_Add(&this->dirty, &fpsRect);
+
+                    if (this->surface && this->surface != this->systemSurface)
                     {
                         // Copy the scanlines from the gdi surface back to pboSurface
                         memcpy((uint8_t*)this->surface + (textRect.top * this->lPitch),
@@ -563,39 +996,91 @@ setup_shaders:
                     }
                 }
 
-                glBindTexture(GL_TEXTURE_2D, this->textures[texIndex]);
+                RECT view = { this->dd->winRect.left, this->dd->winRect.top,
+                    this->dd->winRect.left + this->dd->width, this->dd->winRect.top + this->dd->height };
+
+                if (!EqualRect(&view, &uploadedView))
+                {
+                    uploadedView = view;
+                    DirtyRegion_SetFull(&uploads[0]);
+                    DirtyRegion_SetFull(&uploads[1]);
+                }
+
+                // The buffers in the ring have to catch up on every write, a later view may show what this one cut off
+                DirtyRegion frame, written;
+                changedTiles = TakeFrameDamage(this, &written, &frame, &tiles, &view);
+
+                DirtyRegion_AddRegion(&uploads[0], &frame);
+                DirtyRegion_AddRegion(&uploads[1], &frame);
+
+                DirtyRegion *upload = &uploads[texIndex];
+
+                glBindTexture(this->textureTarget, this->textures[texIndex]);
                 if (this->usingPBO)
                 {
-                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
+                    int next = (this->pboIndex + 1) % this->pboCount;
+                    void *nextSurface = NULL;
 
-                    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->textureWidth, this->textureHeight, texFormat, texType, 0);
+                    // Whatever the game drew this frame is missing from every other buffer in the ring
+                    for (int i = 0; i < this->pboCount; i++)
+                    {
+                        if (i != this->pboIndex)
+                            DirtyRegion_AddRegion(&this->pboStale[i], &written);
+                    }
 
-                    this->pboIndex++;
-                    if (this->pboIndex >= this->pboCount)
-                        this->pboIndex = 0;
+                    if (next != this->pboIndex)
+                    {
+                        nextSurface = MapPBO(this, next);
+                        if (nextSurface && this->surface)
+                            CopyStaleRows(this, nextSurface, this->surface, &this->pboStale[next]);
+                    }
 
-                    if (this->pboCount > 1)
+                    // Persistent slices share one buffer and stay mapped while the GPU reads them
+                    if (this->usingPersistent)
+                    {
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[0]);
+                        UploadRegion(this, upload, (intptr_t)this->pboIndex * this->height * this->lPitch, texFormat, texType);
+                    }
+                    else
                     {
-                        glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbo[this->pboIndex]);
-                        glGetTexImage(GL_TEXTURE_2D, 0, texFormat, texType, 0);
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
+                        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                        UploadRegion(this, upload, 0, texFormat, texType);
                     }
-                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
-                    this->surface = (void*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_READ_WRITE);
+
+                    if (this->pboFences)
+                        this->pboFences[this->pboIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+                    this->pboIndex = next;
+                    this->surface = nextSurface ? nextSurface : MapPBO(this, next);
                 }
                 else
                 {
                     glPixelStorei(GL_UNPACK_ROW_LENGTH, this->width);
-                    glPixelStorei(GL_UNPACK_SKIP_PIXELS, this->dd->winRect.left);
-                    glPixelStorei(GL_UNPACK_SKIP_ROWS, this->dd->winRect.top);
 
-                    glTexSubImage2D(GL_TEXTURE_2D, 0, this->dd->winRect.left, this->dd->winRect.top, this->dd->width, this->dd->height, texFormat, texType, this->surface);
+                    // a full upload is just the whole view as one rect
+                    int count = upload->full ? 1 : upload->count;
+
+                    for (int i = 0; i < count; i++)
+                    {
+                        RECT rc;
+
+                        if (!IntersectRect(&rc, &view, upload->full ? &view : &upload->rects[i]))
+                            continue;
+
+                        glPixelStorei(GL_UNPACK_SKIP_PIXELS, rc.left);
+                        glPixelStorei(GL_UNPACK_SKIP_ROWS, rc.top);
+
+                        glTexSubImage2D(this->textureTarget, 0, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top, texFormat, texType, this->surface);
+                    }
 
                     glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
                     glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
                     glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
                 }
 
+                DirtyRegion_Reset(upload);
+
                 LeaveCriticalSection(&this->lock);
 
                 if (ShouldStretch(this))
@@ -618,11 +1103,26 @@ setup_shaders:
                     glEnd();
                 }
 
-
+                Scheduler_Submit(&sched);
+                double swapStart = CounterGet(&renderCounter);
                 SwapBuffers(this->dd->hDC);
 
-                if (GlFinish || SwapInterval > 0)
+                if (glFenceSync && glClientWaitSync && glDeleteSync)
+                    queueDepth = LimitFramesInFlight(frameFences, &frameFence, framesInFlight);
+                else if (GlFinish || SwapInterval > 0)
                     glFinish();
+
+                if (SwapInterval > 0)
+                {
+                    double vblank, period;
+
+                    // The compositor knows exactly, otherwise only a swap that held us up returned at vblank
+                    if (CounterVblank(&renderCounter, &vblank, &period))
+                        Scheduler_Vblank(&sched, vblank, period);
+                    else if (CounterGet(&renderCounter) - swapStart > SWAP_BLOCKED)
+                        Scheduler_Swapped(&sched);
+                }
+
                 static int errorCheckCount = 0;
                 if (AutoRenderer && errorCheckCount < 3)
                 {
@@ -649,96 +1149,91 @@ setup_shaders:
             EnumChildWindows(this->dd->hWnd, EnumChildProc, (LPARAM)this);
         }
 
-        tick_time = CounterGet(&renderCounter);
-
-        recent_frames[rIndex++] = tick_time;
+        Scheduler_EndFrame(&sched, TargetFPS);
 
-        if (rIndex >= FRAME_SAMPLES)
-            rIndex = 0;
-
-        render_time = 0.0;
-        best_time = 0.0;
-        int bCount = 0;
-        for (int i = 0; i < FRAME_SAMPLES; ++i)
+        if (DrawFPS)
         {
-            render_time += recent_frames[i] < TargetFrameLen ? TargetFrameLen : recent_frames[i];
-            if (recent_frames[i] > 0)
-            {
-                best_time += recent_frames[i];
-                bCount++;
-            }
-        }
+            char tileString[64] = "";
+            if (changedTiles >= 0)
+                _snprintf(tileString, 63, "\nTiles: %d/%d", changedTiles, tiles.columns * tiles.rows);
 
-        avg_fps = 1000.0 / (render_time / FRAME_SAMPLES);
+            char waitString[32];
+            _snprintf(waitString, 31, "\nWait CPU: %2.3f ms", waitCPU);
 
-        avg_len = best_time / bCount;
+            char queueString[32] = "";
+            if (queueDepth >= 0)
+                _snprintf(queueString, 31, "\nQueue: %d/%d", queueDepth, framesInFlight);
 
-        if (DrawFPS)
-        {
-            _snprintf(fpsOglString, 254, "OpenGL%d\nFPS: %3.0f\nTGT: %3.0f\nRender Time: %2.3f ms", convProgram?3:1, avg_fps, TargetFPS, avg_len);
-            _snprintf(fpsGDIString, 254, "GDI\nFPS: %3.0f\nTGT: %3.0f\nRender Time: %2.3f ms", avg_fps, TargetFPS, avg_len);
+            _snprintf(fpsOglString, 254, "OpenGL%d\nFPS: %3.0f\nTGT: %3.0f\nRender Time: %2.3f ms%s%s%s", convProgram?3:1, sched.avgFPS,
+                SwapInterval > 0 ? Scheduler_RefreshRate(&sched) : TargetFPS, sched.avgLen, waitString, queueString, tileString);
+            _snprintf(fpsGDIString, 254, "GDI\nFPS: %3.0f\nTGT: %3.0f\nRender Time: %2.3f ms%s%s", sched.avgFPS, TargetFPS, sched.avgLen, waitString, tileString);
         }
 
-        if (startTargetFPS != TargetFPS)
-        {
-            // TargetFPS was changed externally
-            TargetFrameLen = 1000.0 / TargetFPS;
-            startTargetFPS = TargetFPS;
-        }
+        // Waiting for the game's next frame is capped at a refresh, menus and loading screens that stop
+        // signalling fall back to plain pacing after a few misses. It comes before the pacing wait so the
+        // deadline is taken from when the frame is actually there
+        bool signalled = false;
 
-        tick_time = CounterGet(&renderCounter);
-        if (SwapInterval < 1)
+        if (SyncToGame)
         {
-            if (tick_time < TargetFrameLen)
-            {
-                int sleep = (int)(TargetFrameLen - tick_time);
-                Sleep(sleep);
+            DWORD timeout = missedSignals < SYNC_MISSES ? (DWORD)sched.frameLen + 1 : 0;
 
-                // Finish sub-millisecond sleep
-                while (CounterGet(&renderCounter) < TargetFrameLen);
+            if (WaitForSingleObject(this->syncEvent, timeout) == WAIT_OBJECT_0)
+            {
+                missedSignals = 0;
+                signalled = true;
             }
-        }
-        else if (renderer == RENDERER_OPENGL)
-        {
-            // Calculate optimal sleep time for vsync mode.
-            if (bCount == FRAME_SAMPLES  && rIndex == FRAME_SAMPLES - 1)
+            else if (missedSignals < SYNC_MISSES)
             {
-                if (avg_len < previous_best)
-                {
-                    previous_best = avg_len;
-                    best_sleep = sleep;
-                }
-                else
-                {
-                    descending = sleep > best_sleep;
-                    if (descending)
-                        ceiling = (ceiling + sleep) / 2;
-                    else
-                        floor = (floor - 0.5 + sleep) / 2;
-                }
-                if (descending)
-                    sleep = (sleep + floor)/2;
-                else
-                    sleep = ((ceiling - sleep)/2) + sleep;
+                missedSignals++;
             }
+        }
+
+        // With vsync the wait lines the frame up with the next vblank it can still make. Without, a frame the
+        // game signalled goes out right away and the game does the pacing
+        bool paced = SwapInterval < 1 || renderer == RENDERER_OPENGL;
+
+        if (paced && !(signalled && SwapInterval < 1))
+            FrameTimer_WaitUntil(&frameTimer, &renderCounter, Scheduler_Deadline(&sched, SwapInterval > 0));
+
+        // Blocking on the timer costs nothing, the spin is what shows up as CPU time
+        waitCPU = waitCPU * 0.9 + frameTimer.spinTime * 0.1;
+        frameTimer.spinTime = 0.0;
+
+        // Nobody can see the frames, block until activation, resizing or a repaint says the window might be back.
+        // The timeout catches whatever slips past those messages
+        if (SuspendHidden && WindowHidden(this))
+        {
+            dprintf("Renderer: suspended\n");
+            FrameTimer_Suspend(&frameTimer);
 
-            if (sleep > TargetFrameLen || sleep < 1) sleep = TargetFrameLen;
+            while (this->thread && WindowHidden(this))
+                WaitForSingleObject(this->dd->resumeEvent, SUSPEND_RECHECK);
 
-            CounterStart(&renderCounter);
-            Sleep((int)sleep);
-            while (CounterGet(&renderCounter) < sleep);
+            FrameTimer_Resume(&frameTimer);
+            dprintf("Renderer: resumed\n");
+            InterlockedExchange(&this->dd->focusGained, true);
+            InterlockedExchange(&this->dd->render.repaint, TRUE);
         }
 
         if (InterlockedCompareExchange(&this->dd->focusGained, false, true))
         {
             EnterCriticalSection(&this->lock);
+            DirtyRegion_SetFull(&uploads[0]);
+            DirtyRegion_SetFull(&uploads[1]);
+            presentAll = true;
             switch (InterlockedExchangeAdd(&Renderer, 0))
             {
             case RENDERER_OPENGL:
                 if (this->usingPBO)
                 {
-                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
-                    this->surface = (void*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_READ_WRITE);
+                    this->surface = MapPBO(this, this->pboIndex);
+                }
+                else if (this->watchSurface && this->surface != this->watchSurface)
+                {
+                    memcpy(this->watchSurface, this->systemSurface, this->height * this->lPitch);
+                    this->surface = this->watchSurface;
+                    SelectObject(this->hDC, this->defaultBM);
                 }
                 break;
             case RENDERER_GDI:
@@ -747,14 +1242,22 @@ setup_shaders:
                     this->surface = this->systemSurface;
                     SelectObject(this->hDC, this->bitmap);
                 }
+                else if (this->watchSurface && this->surface == this->watchSurface)
+                {
+                    memcpy(this->systemSurface, this->watchSurface, this->height * this->lPitch);
+                    this->surface = this->systemSurface;
+                    SelectObject(this->hDC, this->bitmap);
+                }
                 break;
 
             default: break;
             }
             LeaveCriticalSection(&this->lock);
         }
-        CounterStart(&renderCounter);
+        Scheduler_BeginFrame(&sched);
     }
 
+    FrameTimer_Free(&frameTimer);
+    TileDiff_Free(&tiles);
     return 0;
 }
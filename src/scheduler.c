@@ -0,0 +1,165 @@
+#include <math.h>
+#include "scheduler.h"
+
+void Scheduler_Init(Scheduler *sched, SchedulerClock now, void *context, double targetFPS)
+{
+    sched->now = now;
+    sched->context = context;
+
+    sched->targetFPS = targetFPS;
+    sched->frameLen = 1000.0 / targetFPS;
+    sched->frameStart = now(context);
+
+    for (int i = 0; i < SCHEDULER_SAMPLES; i++)
+        sched->recentFrames[i] = -1.0;
+
+    sched->index = 0;
+    sched->samples = 0;
+    sched->avgFPS = 0.0;
+    sched->avgLen = sched->frameLen;
+
+    sched->period = sched->frameLen;
+    sched->vblank = -1.0;
+    sched->lastSwap = -1.0;
+    sched->costIndex = 0;
+
+    for (int i = 0; i < SCHEDULER_SAMPLES; i++)
+        sched->submitCost[i] = 0.0;
+}
+
+// Starting point for the refresh period, the swap timestamps refine it from there
+void Scheduler_SetRefreshRate(Scheduler *sched, double hz)
+{
+    if (hz > 1)
+        sched->period = 1000.0 / hz;
+}
+
+double Scheduler_RefreshRate(Scheduler *sched)
+{
+    return 1000.0 / sched->period;
+}
+
+// Called right before presenting, everything since the frame started is what has to fit before vblank
+void Scheduler_Submit(Scheduler *sched)
+{
+    sched->submitCost[sched->costIndex++] = sched->now(sched->context) - sched->frameStart;
+
+    if (sched->costIndex >= SCHEDULER_SAMPLES)
+        sched->costIndex = 0;
+}
+
+// A swap held the caller up until vblank, so now is a vblank too
+void Scheduler_Swapped(Scheduler *sched)
+{
+    double now = sched->now(sched->context);
+
+    if (sched->lastSwap >= 0)
+    {
+        // Intervals close to a whole number of refreshes pull the period towards the real rate
+        double interval = now - sched->lastSwap;
+        double refreshes = floor(interval / sched->period + 0.5);
+
+        if (refreshes >= 1 && fabs(interval - refreshes * sched->period) < sched->period * 0.1)
+            sched->period += (interval / refreshes - sched->period) * 0.05;
+    }
+
+    sched->lastSwap = now;
+
+    if (sched->vblank < 0)
+    {
+        sched->vblank = now;
+        return;
+    }
+
+    // Swaps never return before vblank, an early one means the phase moved while late ones are mostly noise
+    double predicted = sched->vblank + floor((now - sched->vblank) / sched->period + 0.5) * sched->period;
+    double error = now - predicted;
+
+    sched->vblank = predicted + (error < 0 ? error : error * 0.1);
+}
+
+// An exact vblank time and refresh period, taken as they are
+void Scheduler_Vblank(Scheduler *sched, double vblank, double period)
+{
+    if (period > 0)
+        sched->period = period;
+
+    sched->vblank = vblank;
+    sched->lastSwap = vblank;
+}
+
+// Upload and draw cost that nine out of ten recent frames stayed under
+static double SubmitCost(Scheduler *sched)
+{
+    double sorted[SCHEDULER_SAMPLES];
+
+    for (int i = 0; i < SCHEDULER_SAMPLES; i++)
+    {
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > sched->submitCost[i]; j--)
+            sorted[j] = sorted[j - 1];
+
+        sorted[j] = sched->submitCost[i];
+    }
+
+    return sorted[SCHEDULER_SAMPLES * 9 / 10];
+}
+
+void Scheduler_BeginFrame(Scheduler *sched)
+{
+    sched->frameStart = sched->now(sched->context);
+}
+
+// Records how long the frame took, targetFPS may have been changed by hotkeys or focus changes meanwhile
+void Scheduler_EndFrame(Scheduler *sched, double targetFPS)
+{
+    sched->recentFrames[sched->index++] = sched->now(sched->context) - sched->frameStart;
+
+    if (sched->index >= SCHEDULER_SAMPLES)
+        sched->index = 0;
+
+    double renderTime = 0.0;
+    double bestTime = 0.0;
+    int count = 0;
+
+    for (int i = 0; i < SCHEDULER_SAMPLES; i++)
+    {
+        renderTime += sched->recentFrames[i] < sched->frameLen ? sched->frameLen : sched->recentFrames[i];
+        if (sched->recentFrames[i] > 0)
+        {
+            bestTime += sched->recentFrames[i];
+            count++;
+        }
+    }
+
+    sched->samples = count;
+    sched->avgFPS = 1000.0 / (renderTime / SCHEDULER_SAMPLES);
+    sched->avgLen = count ? bestTime / count : sched->frameLen;
+
+    if (targetFPS != sched->targetFPS && targetFPS > 0)
+    {
+        sched->targetFPS = targetFPS;
+        sched->frameLen = 1000.0 / targetFPS;
+    }
+}
+
+// When the next frame should start, on the same clock
+double Scheduler_Deadline(Scheduler *sched, bool vsync)
+{
+    if (!vsync)
+        return sched->frameStart + sched->frameLen;
+
+    double now = sched->now(sched->context);
+
+    if (sched->vblank < 0)
+        return now;
+
+    // Wake up so the frame is done just before the next vblank it can still make
+    double next = sched->vblank + ceil((now - sched->vblank) / sched->period) * sched->period;
+    double wake = next - SubmitCost(sched) - SCHEDULER_SAFETY;
+
+    while (wake < now)
+        wake += sched->period;
+
+    return wake;
+}
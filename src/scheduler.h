@@ -0,0 +1,49 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+
+#define SCHEDULER_SAMPLES 30
+
+// Headroom in ms between the predicted end of a frame and vblank
+#define SCHEDULER_SAFETY 0.75
+
+// Milliseconds from any fixed point, the renderer passes the performance counter
+typedef double (*SchedulerClock)(void *context);
+
+// Frame pacing decisions without any Windows dependency, time only comes in through the clock
+typedef struct
+{
+    SchedulerClock now;
+    void *context;
+
+    double targetFPS;
+    double frameLen;
+    double frameStart;
+
+    double recentFrames[SCHEDULER_SAMPLES];
+    int index;
+    int samples;
+
+    double avgFPS;
+    double avgLen;
+
+    // Vblank prediction, from the compositor or from a SwapBuffers that blocked until vblank
+    double period;
+    double vblank;
+    double lastSwap;
+    double submitCost[SCHEDULER_SAMPLES];
+    int costIndex;
+} Scheduler;
+
+void Scheduler_Init(Scheduler *sched, SchedulerClock now, void *context, double targetFPS);
+void Scheduler_BeginFrame(Scheduler *sched);
+void Scheduler_EndFrame(Scheduler *sched, double targetFPS);
+void Scheduler_SetRefreshRate(Scheduler *sched, double hz);
+void Scheduler_Submit(Scheduler *sched);
+void Scheduler_Swapped(Scheduler *sched);
+void Scheduler_Vblank(Scheduler *sched, double vblank, double period);
+double Scheduler_RefreshRate(Scheduler *sched);
+double Scheduler_Deadline(Scheduler *sched, bool vsync);
+
+#endif
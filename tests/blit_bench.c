@@ -0,0 +1,114 @@
+// Throughput of the pixel kernels in src/blit.c at common game resolutions, in megapixels per second
+#define _POSIX_C_SOURCE 199309L
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "blit.h"
+
+#define MIN_TIME 0.2
+
+typedef enum { FILL, COPY, MIRROR, KEY_SRC, KEY_DEST, STRETCH, STRETCH_BILINEAR, KINDS } Kind;
+
+static const char *names[KINDS] = { "Fill16", "Copy16", "CopyMirror16", "CopyKeySrc16", "CopyKeyDest16",
+                                    "Stretch16", "Stretch16 bilinear" };
+
+static const int sizes[][2] = { { 640, 480 }, { 800, 600 }, { 1024, 768 }, { 1920, 1080 } };
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Run(Kind kind, uint16_t *dst, uint16_t *src, int width, int height, BlitStretchCache *cache)
+{
+    int pitch = width * 2;
+    BlitRect visible = { 0, 0, width, height };
+
+    switch (kind)
+    {
+    case FILL: Blit_Fill16(dst, pitch, width, height, 0x1234, false); break;
+    case COPY: Blit_Copy16(dst, pitch, src, pitch, width, height); break;
+    case MIRROR: Blit_CopyMirror16(dst, pitch, src, pitch, width, height, BLIT_MIRROR_X); break;
+    case KEY_SRC: Blit_CopyKeySrc16(dst, pitch, src, pitch, width, height, 0xF81F); break;
+    case KEY_DEST: Blit_CopyKeyDest16(dst, pitch, src, pitch, width, height, 0xF81F); break;
+    // stretches upscale from half the size, the way a low resolution game fills a larger window
+    case STRETCH:
+        Blit_Stretch16(cache, dst, pitch, width, height, &visible, src, pitch, width / 2, height / 2, false, 0);
+        break;
+    case STRETCH_BILINEAR:
+        Blit_Stretch16(cache, dst, pitch, width, height, &visible, src, pitch, width / 2, height / 2, true, 0);
+        break;
+    default: break;
+    }
+}
+
+static void Bench(const char *level)
+{
+    printf("\n%s%*s", level, 20 - (int)strlen(level), "");
+    for (int i = 0; i < 4; i++)
+        printf("%6dx%-6d", sizes[i][0], sizes[i][1]);
+    printf("\n");
+
+    for (int kind = 0; kind < KINDS; kind++)
+    {
+        printf("%-20s", names[kind]);
+
+        for (int i = 0; i < 4; i++)
+        {
+            int width = sizes[i][0];
+            int height = sizes[i][1];
+            uint16_t *dst = malloc(width * height * 2);
+            uint16_t *src = malloc(width * height * 2);
+            BlitStretchCache cache;
+            memset(&cache, 0, sizeof(cache));
+
+            // a sprite-like mix, a third of the pixels are the key color
+            for (int p = 0; p < width * height; p++)
+            {
+                src[p] = (p % 3) ? (uint16_t)(p * 2654435761u >> 16) : 0xF81F;
+                dst[p] = (p % 5) ? 0x07E0 : 0xF81F;
+            }
+
+            Run(kind, dst, src, width, height, &cache);
+
+            int frames = 0;
+            double start = Now();
+            double elapsed;
+
+            do
+            {
+                Run(kind, dst, src, width, height, &cache);
+                frames++;
+                elapsed = Now() - start;
+            } while (elapsed < MIN_TIME);
+
+            printf("%13.1f", (double)width * height * frames / elapsed / 1e6);
+
+            Blit_FreeStretchCache(&cache);
+            free(dst);
+            free(src);
+        }
+
+        printf("\n");
+    }
+}
+
+int main()
+{
+    Blit_Init();
+
+    Blit_UseAVX2(false);
+    Bench("SSE2 MPix/s");
+
+    if (Blit_UseAVX2(true))
+        Bench("AVX2 MPix/s");
+    else
+        printf("\nAVX2 not available, skipped\n");
+
+    return 0;
+}
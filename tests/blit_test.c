@@ -0,0 +1,571 @@
+// Checks the pixel kernels in src/blit.c against plain scalar versions, with both the SSE2 and the AVX2 dispatch.
+// Sizes, pitches and start addresses are random and include odd values, and every buffer is compared in full so
+// writes outside the rectangle show up too.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blit.h"
+
+#define POOL_SIZE (1 << 20)
+#define ROUNDS 400
+
+static uint8_t *pool[4];
+static int failures = 0;
+static const char *level = "SSE2";
+
+static uint32_t rngState = 0x12345678;
+
+static uint32_t Random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static int RandomRange(int low, int high)
+{
+    return low + (int)(Random() % (uint32_t)(high - low + 1));
+}
+
+// pixels may sit on odd addresses, so every access goes through memcpy
+static uint16_t Get(const uint8_t *base, int pitch, int x, int y)
+{
+    uint16_t px;
+    memcpy(&px, base + y * pitch + x * 2, 2);
+    return px;
+}
+
+static void Put(uint8_t *base, int pitch, int x, int y, uint16_t px)
+{
+    memcpy(base + y * pitch + x * 2, &px, 2);
+}
+
+// a few colors plus the key so masked kernels see runs of both
+static void Scribble(uint8_t *buffer, uint16_t key)
+{
+    uint16_t palette[4] = { key, 0x1234, 0xF81F, 0x07E0 };
+
+    for (int i = 0; i < POOL_SIZE; i += 2)
+    {
+        uint16_t px = (Random() & 3) ? palette[Random() & 3] : (uint16_t)Random();
+        memcpy(buffer + i, &px, 2);
+    }
+}
+
+typedef struct
+{
+    int offset;
+    int pitch;
+} Layout;
+
+static Layout RandomLayout(int width, int height)
+{
+    Layout layout;
+    layout.offset = RandomRange(0, 63);
+    layout.pitch = width * 2 + RandomRange(0, 37);
+
+    if (layout.offset + layout.pitch * height > POOL_SIZE)
+        layout.pitch = width * 2;
+
+    return layout;
+}
+
+static void Check(const char *name, const uint8_t *actual, const uint8_t *expected, int width, int height)
+{
+    if (memcmp(actual, expected, POOL_SIZE) == 0)
+        return;
+
+    int at = 0;
+    while (actual[at] == expected[at])
+        at++;
+
+    failures++;
+    printf("FAIL %s %s %dx%d, first difference at byte %d\n", level, name, width, height, at);
+}
+
+static void TestFill()
+{
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int width = RandomRange(1, 300);
+        int height = RandomRange(1, 9);
+        Layout dst = RandomLayout(width, height);
+        uint16_t color = (uint16_t)Random();
+        bool stream = Random() & 1;
+
+        Scribble(pool[0], 0);
+        memcpy(pool[1], pool[0], POOL_SIZE);
+
+        Blit_Fill16(pool[0] + dst.offset, dst.pitch, width, height, color, stream);
+
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                Put(pool[1] + dst.offset, dst.pitch, x, y, color);
+
+        Check(stream ? "Fill16 stream" : "Fill16", pool[0], pool[1], width, height);
+    }
+}
+
+typedef enum { COPY, MIRROR, KEY_SRC, KEY_DEST } CopyKind;
+
+static void TestCopy(CopyKind kind, const char *name)
+{
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int width = RandomRange(1, 300);
+        int height = RandomRange(1, 9);
+        Layout dst = RandomLayout(width, height);
+        Layout src = RandomLayout(width, height);
+        uint16_t key = (uint16_t)Random();
+        int mirror = RandomRange(0, 3);
+
+        Scribble(pool[0], key);
+        Scribble(pool[2], key);
+        memcpy(pool[1], pool[0], POOL_SIZE);
+
+        uint8_t *d = pool[0] + dst.offset;
+        uint8_t *expected = pool[1] + dst.offset;
+        const uint8_t *s = pool[2] + src.offset;
+
+        switch (kind)
+        {
+        case COPY: Blit_Copy16(d, dst.pitch, s, src.pitch, width, height); break;
+        case MIRROR: Blit_CopyMirror16(d, dst.pitch, s, src.pitch, width, height, mirror); break;
+        case KEY_SRC: Blit_CopyKeySrc16(d, dst.pitch, s, src.pitch, width, height, key); break;
+        case KEY_DEST: Blit_CopyKeyDest16(d, dst.pitch, s, src.pitch, width, height, key); break;
+        }
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                int sx = (kind == MIRROR && (mirror & BLIT_MIRROR_X)) ? width - 1 - x : x;
+                int sy = (kind == MIRROR && (mirror & BLIT_MIRROR_Y)) ? height - 1 - y : y;
+                uint16_t px = Get(s, src.pitch, sx, sy);
+
+                if (kind == KEY_SRC && px == key)
+                    continue;
+
+                if (kind == KEY_DEST && Get(expected, dst.pitch, x, y) != key)
+                    continue;
+
+                Put(expected, dst.pitch, x, y, px);
+            }
+        }
+
+        Check(name, pool[0], pool[1], width, height);
+    }
+}
+
+static void TestMove()
+{
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int width = RandomRange(1, 300);
+        int height = RandomRange(1, 9);
+        int pitch = (width + 40) * 2 + RandomRange(0, 1);
+        int offset = RandomRange(0, 63) + pitch * 12;
+        int dx = RandomRange(-40, 40);
+        int dy = RandomRange(-10, 10);
+
+        Scribble(pool[0], 0);
+        memcpy(pool[1], pool[0], POOL_SIZE);
+
+        // the rectangle scrolls by dx, dy within one surface, overlapping most of the time
+        uint8_t *src = pool[0] + offset;
+        uint8_t *dst = src + dy * pitch + dx * 2;
+
+        Blit_Move16(dst, src, pitch, width, height);
+
+        uint16_t *snapshot = malloc(width * height * 2);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                snapshot[y * width + x] = Get(pool[1] + offset, pitch, x, y);
+
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                Put(pool[1] + offset + dy * pitch + dx * 2, pitch, x, y, snapshot[y * width + x]);
+
+        free(snapshot);
+        Check("Move16", pool[0], pool[1], width, height);
+    }
+}
+
+static inline int Channel(uint16_t px, int c)
+{
+    return c == 0 ? px >> 11 : c == 1 ? (px >> 5) & 63 : px & 31;
+}
+
+// the same 16.16 sampling positions the step tables use, worked out per pixel
+static int32_t SamplePosition(int s, int d, int i, bool bilinear)
+{
+    int64_t step = ((int64_t)s << 16) / d;
+    int64_t pos = step / 2 + step * i - (bilinear ? 0x8000 : 0);
+    int64_t last = (int64_t)(s - 1) << 16;
+    int64_t p = bilinear ? pos : (pos & ~0xFFFF);
+
+    return (int32_t)(p < 0 ? 0 : p > last ? last : p);
+}
+
+static uint16_t Bilinear(const uint8_t *src, int pitch, int srcW, int srcH, int32_t px, int32_t py)
+{
+    int sx = px >> 16;
+    int sy = py >> 16;
+    int sx1 = sx + 1 < srcW ? sx + 1 : sx;
+    int sy1 = sy + 1 < srcH ? sy + 1 : sy;
+    int wx = (px >> 11) & 31;
+    int wy = (py >> 11) & 31;
+    int out[3];
+
+    for (int c = 0; c < 3; c++)
+    {
+        int top = (Channel(Get(src, pitch, sx, sy), c) * (32 - wx) + Channel(Get(src, pitch, sx1, sy), c) * wx) >> 5;
+        int bottom = (Channel(Get(src, pitch, sx, sy1), c) * (32 - wx) + Channel(Get(src, pitch, sx1, sy1), c) * wx) >> 5;
+        out[c] = (top * (32 - wy) + bottom * wy) >> 5;
+    }
+
+    return (uint16_t)((out[0] << 11) | (out[1] << 5) | out[2]);
+}
+
+typedef enum { STRETCH_NEAREST, STRETCH_BILINEAR, STRETCH_KEY_SRC, STRETCH_KEY_DEST } StretchKind;
+
+static void TestStretch(StretchKind kind, const char *name)
+{
+    BlitStretchCache cache;
+    memset(&cache, 0, sizeof(cache));
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int srcW = RandomRange(1, 120);
+        int srcH = RandomRange(1, 40);
+        int dstW = RandomRange(1, 260);
+        int dstH = RandomRange(1, 60);
+        int mirror = RandomRange(0, 3);
+        uint16_t key = (uint16_t)Random();
+        bool bilinear = kind == STRETCH_BILINEAR;
+
+        // only part of the destination may be visible through the clipper
+        BlitRect visible;
+        visible.x = RandomRange(0, dstW - 1);
+        visible.y = RandomRange(0, dstH - 1);
+        visible.w = RandomRange(1, dstW - visible.x);
+        visible.h = RandomRange(1, dstH - visible.y);
+
+        Layout dst = RandomLayout(visible.w, visible.h);
+        Layout src = RandomLayout(srcW, srcH);
+
+        Scribble(pool[0], key);
+        Scribble(pool[2], key);
+        memcpy(pool[1], pool[0], POOL_SIZE);
+
+        uint8_t *d = pool[0] + dst.offset;
+        uint8_t *expected = pool[1] + dst.offset;
+        const uint8_t *s = pool[2] + src.offset;
+
+        switch (kind)
+        {
+        case STRETCH_NEAREST:
+        case STRETCH_BILINEAR:
+            Blit_Stretch16(&cache, d, dst.pitch, dstW, dstH, &visible, s, src.pitch, srcW, srcH, bilinear, mirror);
+            break;
+        case STRETCH_KEY_SRC:
+            Blit_StretchKeySrc16(&cache, d, dst.pitch, dstW, dstH, &visible, s, src.pitch, srcW, srcH, key, mirror);
+            break;
+        case STRETCH_KEY_DEST:
+            Blit_StretchKeyDest16(&cache, d, dst.pitch, dstW, dstH, &visible, s, src.pitch, srcW, srcH, key, mirror);
+            break;
+        }
+
+        for (int y = 0; y < visible.h; y++)
+        {
+            int dy = visible.y + y;
+            int32_t py = SamplePosition(srcH, dstH, (mirror & BLIT_MIRROR_Y) ? dstH - 1 - dy : dy, bilinear);
+
+            for (int x = 0; x < visible.w; x++)
+            {
+                int dx = visible.x + x;
+                int32_t px = SamplePosition(srcW, dstW, (mirror & BLIT_MIRROR_X) ? dstW - 1 - dx : dx, bilinear);
+                uint16_t color = bilinear ? Bilinear(s, src.pitch, srcW, srcH, px, py)
+                                          : Get(s, src.pitch, px >> 16, py >> 16);
+
+                if (kind == STRETCH_KEY_SRC && color == key)
+                    continue;
+
+                if (kind == STRETCH_KEY_DEST && Get(expected, dst.pitch, x, y) != key)
+                    continue;
+
+                Put(expected, dst.pitch, x, y, color);
+            }
+        }
+
+        Check(name, pool[0], pool[1], visible.w, visible.h);
+    }
+
+    Blit_FreeStretchCache(&cache);
+}
+
+// the output is R, G, B, A in memory, every channel widened by repeating its top bits
+static void TestConvert()
+{
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int width = RandomRange(1, 150);
+        int height = RandomRange(1, 9);
+        Layout src = RandomLayout(width, height);
+        Layout dst = RandomLayout(width * 2, height);
+
+        Scribble(pool[0], 0);
+        Scribble(pool[2], 0);
+        memcpy(pool[1], pool[0], POOL_SIZE);
+
+        const uint8_t *s = pool[2] + src.offset;
+
+        Blit_Convert565To8888(pool[0] + dst.offset, dst.pitch, s, src.pitch, width, height);
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                uint16_t px = Get(s, src.pitch, x, y);
+                int r = px >> 11, g = (px >> 5) & 63, b = px & 31;
+                uint8_t *out = pool[1] + dst.offset + y * dst.pitch + x * 4;
+
+                out[0] = (uint8_t)(r << 3 | r >> 2);
+                out[1] = (uint8_t)(g << 2 | g >> 4);
+                out[2] = (uint8_t)(b << 3 | b >> 2);
+                out[3] = 0xFF;
+            }
+        }
+
+        Check("Convert565To8888", pool[0], pool[1], width, height);
+    }
+}
+
+// runs that are all key, have no key at all or flip every pixel stress the span edges and row tails
+static void KeyPattern(uint8_t *buffer, uint16_t key, int pattern)
+{
+    if (pattern == 0)
+    {
+        Scribble(buffer, key);
+        return;
+    }
+
+    for (int i = 0; i < POOL_SIZE; i += 2)
+    {
+        uint16_t px = pattern == 1 ? key : pattern == 2 ? (uint16_t)(key ^ 1) : (i / 2 & 1) ? key : (uint16_t)~key;
+        memcpy(buffer + i, &px, 2);
+    }
+}
+
+static void TestSpans()
+{
+    BlitSpanTable table;
+    memset(&table, 0, sizeof(table));
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int srcW = RandomRange(1, 300);
+        int srcH = RandomRange(1, 20);
+        int width = RandomRange(1, srcW);
+        int height = RandomRange(1, srcH);
+        int srcX = RandomRange(0, srcW - width);
+        int srcY = RandomRange(0, srcH - height);
+        Layout dst = RandomLayout(width, height);
+        Layout src = RandomLayout(srcW, srcH);
+        uint16_t key = (uint16_t)Random();
+
+        Scribble(pool[0], key);
+        KeyPattern(pool[2], key, round % 4);
+        memcpy(pool[1], pool[0], POOL_SIZE);
+
+        const uint8_t *s = pool[2] + src.offset;
+
+        Blit_BuildSpans16(&table, s, src.pitch, srcW, srcH, key);
+        Blit_CopySpans16(&table, pool[0] + dst.offset, dst.pitch, s, src.pitch, srcX, srcY, width, height);
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                uint16_t px = Get(s, src.pitch, srcX + x, srcY + y);
+
+                if (px != key)
+                    Put(pool[1] + dst.offset, dst.pitch, x, y, px);
+            }
+        }
+
+        Check("CopySpans16", pool[0], pool[1], width, height);
+    }
+
+    Blit_FreeSpans(&table);
+}
+
+static uint32_t HashStep(uint32_t h, uint32_t v)
+{
+    h = (h ^ v) * 0x9E3779B1u;
+    return h ^ (h >> 15);
+}
+
+// the same lanes as Blit_Hash16 written out one pixel at a time
+static uint64_t ReferenceHash(const uint8_t *src, int pitch, int width, int height)
+{
+    uint32_t lanes[9] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+
+    for (int y = 0; y < height; y++)
+    {
+        int chunks = width / 8 * 8;
+
+        for (int x = 0; x < chunks; x++)
+            lanes[x % 8] = HashStep(lanes[x % 8], Get(src, pitch, x, y));
+
+        for (int x = chunks; x < width; x++)
+            lanes[8] = HashStep(lanes[8], Get(src, pitch, x, y));
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (int i = 0; i < 9; i++)
+    {
+        hash ^= lanes[i];
+        hash *= 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+static void ExpectChange(const char *name, uint8_t *src, int pitch, int width, int height, const int (*edits)[3],
+                         int count)
+{
+    uint64_t before = Blit_Hash16(src, pitch, width, height);
+    memcpy(pool[1], pool[0], POOL_SIZE);
+
+    for (int i = 0; i < count; i++)
+    {
+        int x = (edits[i][0] % width + width) % width;
+        int y = edits[i][1] % height;
+        Put(src, pitch, x, y, (uint16_t)(Get(src, pitch, x, y) + edits[i][2]));
+    }
+
+    // on small rectangles edits can land on the same pixel and undo each other
+    if (memcmp(pool[0], pool[1], POOL_SIZE) == 0)
+        return;
+
+    if (Blit_Hash16(src, pitch, width, height) == before)
+    {
+        failures++;
+        printf("FAIL %s Hash16 %s %dx%d collides\n", level, name, width, height);
+    }
+}
+
+static void TestHash()
+{
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int width = RandomRange(1, 100);
+        int height = RandomRange(1, 20);
+        Layout src = RandomLayout(width, height);
+        uint8_t *s = pool[0] + src.offset;
+
+        Scribble(pool[0], 0);
+
+        if (Blit_Hash16(s, src.pitch, width, height) != ReferenceHash(s, src.pitch, width, height))
+        {
+            failures++;
+            printf("FAIL %s Hash16 %dx%d differs from the reference\n", level, width, height);
+        }
+
+        // sums per lane miss all of these
+        int d = RandomRange(1, 300);
+        int lane[][3] = { { 0, 0, d }, { 8, 0, -2 * d }, { 16, 0, d } };
+        int tail[][3] = { { width - 3, 0, d }, { width - 2, 0, -2 * d }, { width - 1, 0, d } };
+        int rows[][3] = { { 0, 0, d }, { 0, 1, -2 * d }, { 0, 2, d } };
+        int swap[][3] = { { 0, 0, d }, { 1, 0, -d } };
+
+        ExpectChange("+d -2d +d along a lane", s, src.pitch, width, height, lane, 3);
+        ExpectChange("+d -2d +d in the tail", s, src.pitch, width, height, tail, 3);
+        ExpectChange("+d -2d +d down a column", s, src.pitch, width, height, rows, 3);
+        ExpectChange("moved value", s, src.pitch, width, height, swap, 2);
+
+        int single[][3] = { { RandomRange(0, width - 1), RandomRange(0, height - 1), RandomRange(1, 65535) } };
+        ExpectChange("single pixel", s, src.pitch, width, height, single, 1);
+    }
+}
+
+static void ExpectTrim(const char *name, BlitRect src, int dstW, int dstH, int mirror, bool keyed,
+                       int trimmedW, int trimmedH, bool stretch)
+{
+    bool result = Blit_TrimSource(&src, 100, 80, dstW, dstH, mirror, keyed);
+
+    if (result != stretch || src.w != trimmedW || src.h != trimmedH)
+    {
+        failures++;
+        printf("FAIL %s Blit_TrimSource %s, got %dx%d stretch %d\n", level, name, src.w, src.h, result);
+    }
+}
+
+// BltBatch only splits blits into bands that stay off the shared stretch tables, and decides so before trimming
+static void TestTrimSource()
+{
+    ExpectTrim("same size", (BlitRect){ 10, 10, 50, 40 }, 50, 40, 0, false, 50, 40, false);
+    ExpectTrim("scaled", (BlitRect){ 10, 10, 50, 40 }, 100, 40, 0, false, 50, 40, true);
+    ExpectTrim("past the right edge", (BlitRect){ 20, 0, 100, 40 }, 100, 40, 0, false, 80, 40, true);
+    ExpectTrim("past the bottom edge", (BlitRect){ 0, 50, 60, 40 }, 60, 40, 0, false, 60, 30, true);
+    ExpectTrim("oversized both ways", (BlitRect){ 0, 0, 120, 90 }, 120, 90, 0, false, 100, 80, true);
+    ExpectTrim("mirrored", (BlitRect){ 0, 0, 50, 40 }, 50, 40, BLIT_MIRROR_X, false, 50, 40, false);
+    ExpectTrim("keyed mirror", (BlitRect){ 0, 0, 50, 40 }, 50, 40, BLIT_MIRROR_Y, true, 50, 40, true);
+}
+
+static void TestAll()
+{
+    TestFill();
+    TestCopy(COPY, "Copy16");
+    TestCopy(MIRROR, "CopyMirror16");
+    TestCopy(KEY_SRC, "CopyKeySrc16");
+    TestCopy(KEY_DEST, "CopyKeyDest16");
+    TestMove();
+    TestStretch(STRETCH_NEAREST, "Stretch16");
+    TestStretch(STRETCH_BILINEAR, "Stretch16 bilinear");
+    TestStretch(STRETCH_KEY_SRC, "StretchKeySrc16");
+    TestStretch(STRETCH_KEY_DEST, "StretchKeyDest16");
+    TestSpans();
+    TestHash();
+    TestConvert();
+    TestTrimSource();
+}
+
+int main()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        pool[i] = malloc(POOL_SIZE);
+        if (!pool[i])
+            return 2;
+    }
+
+    Blit_Init();
+
+    Blit_UseAVX2(false);
+    TestAll();
+    printf("SSE2 kernels checked\n");
+
+    if (Blit_UseAVX2(true))
+    {
+        level = "AVX2";
+        TestAll();
+        printf("AVX2 kernels checked\n");
+    }
+    else
+    {
+        printf("AVX2 not available, skipped\n");
+    }
+
+    for (int i = 0; i < 4; i++)
+        free(pool[i]);
+
+    printf(failures ? "%d failures\n" : "all passed\n", failures);
+    return failures ? 1 : 0;
+}
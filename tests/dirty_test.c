@@ -0,0 +1,315 @@
+// Checks the damage tracking in src/dirty.c with the host compiler, tests/win32/windows.h stands in for the few
+// rect helpers it takes from Win32. Every rect is also painted into a plain bitmap of the surface, the region has to
+// cover whatever was painted and its own rects must never overlap.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dirty.h"
+#include "blit.h"
+
+#define WIDTH 320
+#define HEIGHT 200
+#define ROUNDS 2000
+
+static int failures = 0;
+static uint8_t painted[HEIGHT][WIDTH];
+
+static uint32_t rngState = 0x2545F491;
+
+static uint32_t Random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static int RandomRange(int low, int high)
+{
+    return low + (int)(Random() % (uint32_t)(high - low + 1));
+}
+
+// may reach past the surface on any side, Add clips
+static RECT RandomRect()
+{
+    int left = RandomRange(-20, WIDTH + 10);
+    int top = RandomRange(-20, HEIGHT + 10);
+    RECT rc = { left, top, left + RandomRange(1, 60), top + RandomRange(1, 40) };
+    return rc;
+}
+
+static void Paint(const RECT *rc)
+{
+    for (int y = rc->top < 0 ? 0 : rc->top; y < rc->bottom && y < HEIGHT; y++)
+        for (int x = rc->left < 0 ? 0 : rc->left; x < rc->right && x < WIDTH; x++)
+            painted[y][x] = 1;
+}
+
+static bool Covered(const DirtyRegion *region, int x, int y)
+{
+    if (region->full)
+        return true;
+
+    for (int i = 0; i < region->count; i++)
+    {
+        const RECT *rc = &region->rects[i];
+
+        if (x >= rc->left && x < rc->right && y >= rc->top && y < rc->bottom)
+            return true;
+    }
+
+    return false;
+}
+
+static void CheckRegion(const char *name, const DirtyRegion *region, int round)
+{
+    if (region->count > DIRTY_MAX_RECTS || (region->full && region->count != 0))
+    {
+        failures++;
+        printf("FAIL %s round %d, %d rects full %d\n", name, round, region->count, region->full);
+        return;
+    }
+
+    for (int i = 0; i < region->count; i++)
+    {
+        const RECT *a = &region->rects[i];
+
+        if (a->left < 0 || a->top < 0 || a->right > WIDTH || a->bottom > HEIGHT || IsRectEmpty(a))
+        {
+            failures++;
+            printf("FAIL %s round %d, rect %d is outside the surface or empty\n", name, round, i);
+            return;
+        }
+
+        for (int j = i + 1; j < region->count; j++)
+        {
+            RECT overlap;
+
+            if (IntersectRect(&overlap, a, &region->rects[j]))
+            {
+                failures++;
+                printf("FAIL %s round %d, rects %d and %d overlap\n", name, round, i, j);
+                return;
+            }
+        }
+    }
+
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            if (painted[y][x] && !Covered(region, x, y))
+            {
+                failures++;
+                printf("FAIL %s round %d, pixel %d,%d was lost\n", name, round, x, y);
+                return;
+            }
+        }
+    }
+}
+
+static void TestAdd()
+{
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        DirtyRegion region;
+        DirtyRegion_Init(&region, WIDTH, HEIGHT, RandomRange(1, 100));
+        DirtyRegion_Reset(&region);
+        memset(painted, 0, sizeof(painted));
+
+        int adds = RandomRange(1, 40);
+
+        for (int i = 0; i < adds; i++)
+        {
+            RECT rc = RandomRect();
+            Paint(&rc);
+            DirtyRegion_Add(&region, &rc);
+        }
+
+        CheckRegion("DirtyRegion_Add", &region, round);
+
+        // the copy the render thread makes has to hold on to all of it as well
+        DirtyRegion merged;
+        DirtyRegion_Init(&merged, WIDTH, HEIGHT, region.threshold);
+        DirtyRegion_Reset(&merged);
+
+        RECT extra = RandomRect();
+        Paint(&extra);
+        DirtyRegion_Add(&merged, &extra);
+        DirtyRegion_AddRegion(&merged, &region);
+
+        CheckRegion("DirtyRegion_AddRegion", &merged, round);
+    }
+}
+
+static void TestThreshold()
+{
+    DirtyRegion region;
+    DirtyRegion_Init(&region, WIDTH, HEIGHT, 50);
+    DirtyRegion_Reset(&region);
+
+    RECT left = { 0, 0, WIDTH / 2 - 1, HEIGHT };
+    DirtyRegion_Add(&region, &left);
+
+    if (region.full)
+    {
+        failures++;
+        printf("FAIL DirtyRegion threshold, full below 50%%\n");
+    }
+
+    RECT strip = { WIDTH / 2 - 1, 0, WIDTH / 2, HEIGHT };
+    DirtyRegion_Add(&region, &strip);
+
+    if (!region.full)
+    {
+        failures++;
+        printf("FAIL DirtyRegion threshold, not full at 50%%\n");
+    }
+
+    // a null rect is the whole surface, like Lock without a rect
+    DirtyRegion_Reset(&region);
+    DirtyRegion_Add(&region, NULL);
+
+    if (!region.full)
+    {
+        failures++;
+        printf("FAIL DirtyRegion null rect\n");
+    }
+}
+
+static void SetPixel(uint16_t *surface, int x, int y, uint16_t px)
+{
+    surface[y * WIDTH + x] = px;
+}
+
+// Only tiles inside the area that were damaged and whose pixels changed come back, the rest of the damage is
+// dropped and the hashes outside the area stay as they were
+static void TestTileDiff()
+{
+    static uint16_t surface[WIDTH * HEIGHT];
+    static uint16_t previous[WIDTH * HEIGHT];
+    TileDiff diff;
+
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        surface[i] = (uint16_t)Random();
+
+    if (!TileDiff_Init(&diff, WIDTH, HEIGHT))
+    {
+        failures++;
+        printf("FAIL TileDiff_Init\n");
+        return;
+    }
+
+    RECT all = { 0, 0, WIDTH, HEIGHT };
+    DirtyRegion region;
+    DirtyRegion_Init(&region, WIDTH, HEIGHT, 100);
+    TileDiff_Update(&diff, &region, surface, WIDTH * 2, &all);
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        memcpy(previous, surface, sizeof(surface));
+        memset(painted, 0, sizeof(painted));
+
+        DirtyRegion_Init(&region, WIDTH, HEIGHT, 100);
+        DirtyRegion_Reset(&region);
+
+        RECT area = all;
+        if (round & 1)
+        {
+            area.left = RandomRange(0, WIDTH / 2);
+            area.top = RandomRange(0, HEIGHT / 2);
+            area.right = RandomRange(area.left + 1, WIDTH);
+            area.bottom = RandomRange(area.top + 1, HEIGHT);
+        }
+
+        // damage that rewrites the same pixels, and some real changes under damage of their own
+        int rects = RandomRange(0, 6);
+        for (int i = 0; i < rects; i++)
+        {
+            RECT rc = RandomRect();
+            DirtyRegion_Add(&region, &rc);
+        }
+
+        int pixels = RandomRange(0, 6);
+        for (int i = 0; i < pixels; i++)
+        {
+            int x = RandomRange(0, WIDTH - 1);
+            int y = RandomRange(0, HEIGHT - 1);
+            RECT rc = { x, y, x + 1, y + 1 };
+
+            SetPixel(surface, x, y, (uint16_t)(surface[y * WIDTH + x] + RandomRange(1, 65535)));
+            DirtyRegion_Add(&region, &rc);
+        }
+
+        // a tile that reaches into the area is hashed whole
+        int expected = 0;
+        for (int ty = 0; ty < diff.rows; ty++)
+        {
+            for (int tx = 0; tx < diff.columns; tx++)
+            {
+                RECT tile = { tx * TILE_WIDTH, ty * TILE_HEIGHT, (tx + 1) * TILE_WIDTH, (ty + 1) * TILE_HEIGHT };
+                RECT inside;
+                bool changed = false;
+
+                IntersectRect(&tile, &tile, &all);
+                if (!IntersectRect(&inside, &tile, &area))
+                    continue;
+
+                for (int y = tile.top; y < tile.bottom; y++)
+                {
+                    for (int x = tile.left; x < tile.right; x++)
+                    {
+                        if (surface[y * WIDTH + x] != previous[y * WIDTH + x])
+                        {
+                            painted[y][x] = 1;
+                            changed = true;
+                        }
+                    }
+                }
+
+                expected += changed;
+            }
+        }
+
+        int count = TileDiff_Update(&diff, &region, surface, WIDTH * 2, &area);
+
+        if (count != expected)
+        {
+            failures++;
+            printf("FAIL TileDiff_Update round %d, %d tiles changed, expected %d\n", round, count, expected);
+        }
+
+        CheckRegion("TileDiff_Update", &region, round);
+
+        // changes outside the area are caught once it covers them, nothing is left over after that
+        DirtyRegion_Init(&region, WIDTH, HEIGHT, 100);
+        TileDiff_Update(&diff, &region, surface, WIDTH * 2, &all);
+        DirtyRegion_Init(&region, WIDTH, HEIGHT, 100);
+
+        if (TileDiff_Update(&diff, &region, surface, WIDTH * 2, &all) != 0)
+        {
+            failures++;
+            printf("FAIL TileDiff_Update round %d, unchanged surface reported changes\n", round);
+        }
+    }
+
+    TileDiff_Free(&diff);
+}
+
+int main()
+{
+    TestAdd();
+    TestThreshold();
+    TestTileDiff();
+
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+
+    printf("all passed\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Drives src/scheduler.c through its clock callback against a simulated display. Every frame costs a sample
+// from a synthetic render time distribution and with vsync the swap returns at the first vblank after the work
+// is done, the same way the OpenGL renderer uses the scheduler. Each case runs once timed by the swap alone and
+// once with exact vblank times as the compositor reports them.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "scheduler.h"
+
+#define FRAMES 6000
+#define WARMUP 300
+// the waitable timer wakes a little late now and then
+#define WAKE_JITTER 0.05
+
+typedef struct
+{
+    const char *name;
+    double (*sample)(double period);
+} Distribution;
+
+typedef struct
+{
+    double reported;
+    double actual;
+} Display;
+
+static double simTime = 0.0;
+static uint32_t rngState = 0x9E3779B9;
+
+static double Clock(void *context)
+{
+    return simTime;
+}
+
+static double Random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return (rngState >> 8) / 16777216.0;
+}
+
+static double Steady(double period) { return period * 0.25; }
+static double Uniform(double period) { return period * (0.1 + Random() * 0.4); }
+static double Spiky(double period) { return Random() < 0.02 ? period * 1.3 : period * 0.2; }
+static double Bimodal(double period) { return Random() < 0.5 ? period * 0.1 : period * 0.45; }
+static double Heavy(double period) { return period * 0.15 - log(1.0 - Random()) * period * 0.05; }
+
+static const Distribution distributions[] = {
+    { "steady 25%", Steady },
+    { "uniform 10-50%", Uniform },
+    { "spikes 2% at 130%", Spiky },
+    { "bimodal 10/45%", Bimodal },
+    { "exponential tail", Heavy },
+};
+
+static const Display displays[] = {
+    { 60.0, 60.0 },
+    { 60.0, 59.94 },
+    { 75.0, 75.0 },
+    { 120.0, 120.0 },
+    { 144.0, 143.9 },
+    { 165.0, 165.0 },
+    // the mode query failed and the configured frame rate was all there was
+    { 0.0, 60.0 },
+};
+
+static int CompareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool Simulate(const Display *display, const Distribution *dist, bool compositor)
+{
+    double period = 1000.0 / display->actual;
+    double phase = Random() * period;
+    static double intervals[FRAMES];
+    int count = 0;
+    int missed = 0;
+    int spikes = 0;
+    double lastPresent = 0.0;
+    double firstPresent = 0.0;
+
+    simTime = 0.0;
+
+    Scheduler sched;
+    Scheduler_Init(&sched, Clock, NULL, display->reported > 0 ? display->reported : 60.0);
+    Scheduler_SetRefreshRate(&sched, display->reported);
+
+    for (int frame = 0; frame < FRAMES; frame++)
+    {
+        Scheduler_BeginFrame(&sched);
+
+        double cost = dist->sample(period);
+        simTime += cost;
+        Scheduler_Submit(&sched);
+
+        // the swap blocks until the next vblank
+        double vblank = phase + ceil((simTime - phase) / period) * period;
+        simTime = vblank + Random() * 0.02;
+
+        if (compositor)
+            Scheduler_Vblank(&sched, vblank, period);
+        else
+            Scheduler_Swapped(&sched);
+
+        if (frame == WARMUP)
+        {
+            firstPresent = vblank;
+        }
+        else if (frame > WARMUP)
+        {
+            double interval = vblank - lastPresent;
+            intervals[count++] = interval;
+
+            // a frame that could have made its vblank but didn't
+            if (interval > period * 1.5)
+            {
+                if (cost > period)
+                    spikes++;
+                else
+                    missed++;
+            }
+        }
+
+        lastPresent = vblank;
+
+        Scheduler_EndFrame(&sched, display->reported > 0 ? display->reported : 60.0);
+
+        double wake = Scheduler_Deadline(&sched, true);
+        if (wake > simTime)
+            simTime = wake;
+
+        simTime += Random() * WAKE_JITTER;
+    }
+
+    double fps = count * 1000.0 / (lastPresent - firstPresent);
+    qsort(intervals, count, sizeof(double), CompareDouble);
+
+    double p50 = intervals[count / 2];
+    double p99 = intervals[count * 99 / 100];
+    double detected = Scheduler_RefreshRate(&sched);
+
+    // only steady frames that fit comfortably are held to a hard limit
+    bool ok = dist->sample != Steady || missed * 100 <= count;
+
+    printf("%7.2f %7.2f  %-6s %-18s %8.2f %8.3f %8.3f %7d %7d %9.2f%s\n", display->reported, display->actual,
+           compositor ? "dwm" : "swap", dist->name, fps, p50, p99, missed, spikes, detected, ok ? "" : "  FAIL");
+
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+
+    printf("%7s %7s  %-6s %-18s %8s %8s %8s %7s %7s %9s\n", "mode Hz", "real Hz", "vblank", "render time", "fps",
+           "p50 ms", "p99 ms", "missed", "over", "detected");
+
+    for (size_t d = 0; d < sizeof(displays) / sizeof(displays[0]); d++)
+    {
+        for (int compositor = 0; compositor < 2; compositor++)
+        {
+            for (size_t r = 0; r < sizeof(distributions) / sizeof(distributions[0]); r++)
+                ok = Simulate(&displays[d], &distributions[r], compositor) && ok;
+        }
+    }
+
+    printf("\nmissed: vblanks lost by frames that would have fit, over: frames longer than a refresh\n");
+    return ok ? 0 : 1;
+}
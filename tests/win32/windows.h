@@ -0,0 +1,55 @@
+// Just enough of windows.h for src/dirty.c to build with the host compiler
+#pragma once
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef long LONG;
+typedef long long LONGLONG;
+typedef int BOOL;
+
+typedef struct
+{
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+} RECT;
+
+static inline BOOL IsRectEmpty(const RECT *rc)
+{
+    return rc->left >= rc->right || rc->top >= rc->bottom;
+}
+
+static inline BOOL IntersectRect(RECT *dst, const RECT *a, const RECT *b)
+{
+    RECT r = { a->left > b->left ? a->left : b->left, a->top > b->top ? a->top : b->top,
+               a->right < b->right ? a->right : b->right, a->bottom < b->bottom ? a->bottom : b->bottom };
+
+    if (IsRectEmpty(&r))
+    {
+        *dst = (RECT){ 0, 0, 0, 0 };
+        return false;
+    }
+
+    *dst = r;
+    return true;
+}
+
+static inline BOOL UnionRect(RECT *dst, const RECT *a, const RECT *b)
+{
+    if (IsRectEmpty(a))
+    {
+        *dst = *b;
+        return !IsRectEmpty(b);
+    }
+
+    if (IsRectEmpty(b))
+    {
+        *dst = *a;
+        return true;
+    }
+
+    *dst = (RECT){ a->left < b->left ? a->left : b->left, a->top < b->top ? a->top : b->top,
+                   a->right > b->right ? a->right : b->right, a->bottom > b->bottom ? a->bottom : b->bottom };
+    return true;
+}